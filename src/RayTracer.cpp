@@ -6,6 +6,8 @@
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/shadowQueue.h"
+#include "scene/shadingCache.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
@@ -13,6 +15,8 @@
 #include "ui/TraceUI.h"
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 //#include "ui/CubeMapChooser.h"
 
 extern TraceUI* traceUI;
@@ -29,149 +33,767 @@ using namespace std;
 // in TraceGLWindow, for example.
 bool debugMode = false;
 
+// Index of the pixel the calling thread is tracing, for the G-buffer.
+static thread_local int currentPixel = 0;
+
+// Primary rays the calling thread has traced that hit something, for the
+// frame buffer's coverage.
+static thread_local int primaryHits = 0;
+
+// Where the calling thread counts its rays while it works on a parallel
+// pass; m_rayCounts when it's NULL.
+static thread_local std::vector<unsigned long long>* threadRayCounts = NULL;
+
+// The hit cache entry the calling thread's next primary ray replays or
+// fills in, and the film position that ray goes through.
+static thread_local PrimaryHitCache::Entry* primaryEntry = NULL;
+static thread_local double primaryX = 0.0, primaryY = 0.0;
+
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 
 Vec3d RayTracer::trace( double x, double y )
+{
+    Vec3d ret = tracePrimary(x, y);
+	ret.clamp();
+	return ret;
+}
+
+// trace() before clamping; with a ShadowQueue active, the light that
+// still has to be shadowed is missing from it.
+Vec3d RayTracer::tracePrimary( double x, double y )
 {
 	// Clear out the ray cache in the scene for debugging purposes,
     ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
     scene->getCamera().rayThrough( x,y,r );
-    Vec3d ret = traceRay(r, Vec3d(1.f,1.f,1.f), traceUI->getDepth());
-	ret.clamp();
-	return ret;
+    // A traced debug ray must go through Scene::intersect() to be recorded.
+    primaryEntry = NULL;
+    if(m_settings.hitCache && !debugMode)
+    {
+        primaryEntry = m_hitCache.entry(currentPixel, Sampler::current().sampleIndex());
+        primaryX = x;
+        primaryY = y;
+    }
+    return traceRay(r, Vec3d(1.f,1.f,1.f), m_settings.depth);
+}
+
+// Trace the pixels in [x0, x1) x [y0, y1).  With one sample per pixel the
+// tile's shadow rays are queued while it is shaded and traced afterwards,
+// grouped by light; supersampled pixels combine clamped samples, and the
+// adaptive sampler looks at each one as it comes, so they are traced
+// pixel by pixel.  Every path records the samples each pixel took in
+// sampleCounts(), accumulates unclamped colour in the frame buffer, and
+// tone maps the tile into the 8-bit buffer when it is done.
+void RayTracer::traceTile( int x0, int y0, int x1, int y1 )
+{
+    if( ! sceneLoaded() ) return;
+    ShadingCache::clearThread();
+    if(m_settings.reduction > 1)
+    {
+        traceReducedTile(x0, y0, x1, y1);
+        toneMap(x0, y0, x1, y1);
+        return;
+    }
+    // With edge redraw on this is the first pass, at one sample per
+    // pixel; resampleEdges() supersamples where it's needed.
+    bool supersampled = m_settings.sampleSize > 1 && !m_settings.edgeRedraw;
+    if(supersampled && m_settings.sharedSamples && !m_settings.adaptiveSampling)
+    {
+        traceLatticeTile(x0, y0, x1, y1);
+        toneMap(x0, y0, x1, y1);
+        return;
+    }
+    if(supersampled)
+    {
+        for(int j = y0; j < y1; ++j)
+            for(int i = x0; i < x1; ++i)
+                tracePixel(i, j);
+        return;
+    }
+
+    static thread_local ShadowQueue queue;
+    static thread_local std::vector<Vec3d> colors;
+    static thread_local std::vector<unsigned char> hits;
+    int width = x1 - x0;
+    colors.resize(width * (y1 - y0));
+    hits.resize(width * (y1 - y0));
+    queue.begin();
+    for(int j = y0; j < y1; ++j)
+    {
+        for(int i = x0; i < x1; ++i)
+        {
+            int slot = (i - x0) + (j - y0) * width;
+            currentPixel = pixelIndex(i, j);
+            queue.setSlot(slot);
+            Sampler::current().startSample(i, j, 0);
+            primaryHits = 0;
+            colors[slot] = tracePrimary(double(i)/double(buffer_width), double(j)/double(buffer_height));
+            hits[slot] = primaryHits;
+        }
+    }
+    queue.end();
+    queue.resolve(colors);
+
+    for(int j = y0; j < y1; ++j)
+    {
+        for(int i = x0; i < x1; ++i)
+        {
+            int slot = (i - x0) + (j - y0) * width;
+            m_gbuffer.setSamples(pixelIndex(i, j), 1);
+            m_frame.set(pixelIndex(i, j), colors[slot], hits[slot], 1.0);
+        }
+    }
+    toneMap(x0, y0, x1, y1);
+}
+
+// Tone map [x0, x1) x [y0, y1) of the frame buffer into the 8-bit buffer
+// that is displayed and saved.
+void RayTracer::toneMap( int x0, int y0, int x1, int y1 )
+{
+    FrameBuffer::ToneMap op = (FrameBuffer::ToneMap)m_settings.toneMap;
+    for(int j = y0; j < y1; ++j)
+        m_frame.toneMap(buffer, pixelIndex(x0, j), pixelIndex(x1, j), m_settings.exposure, op);
+}
+
+// toneMap() over all the rows held, across worker threads.
+void RayTracer::toneMapAll()
+{
+    parallelChunks(m_firstRow, m_firstRow + buffer_rows, [&](int y0, int y1, unsigned int) {
+        toneMap(0, y0, buffer_width, y1);
+    });
 }
 
 
+// Supersample [x0, x1) x [y0, y1) on a lattice shared between pixels.
+// With n samples a side, pixel corners are lattice points and a pixel
+// spans m = n - 1 lattice steps, so the samples on its edges and corners
+// are its neighbours' too, and the tile traces each of them once: about
+// m^2 rays per pixel instead of n^2.  A pixel is the trapezoid rule over
+// its (m + 1)^2 points, with edge samples counting half and corners a
+// quarter.
+void RayTracer::traceLatticeTile( int x0, int y0, int x1, int y1 )
+{
+    const int m = std::max(m_settings.sampleSize - 1, 1);
+    const double step = 1.0 / m;
+    const int cols = (x1 - x0) * m + 1;
+    const int rows = (y1 - y0) * m + 1;
+    static thread_local std::vector<Vec3d> lattice;
+    static thread_local std::vector<unsigned char> latticeHits;
+    lattice.resize(cols * rows);
+    latticeHits.resize(cols * rows);
+
+    Jitter<double> jitter(step / 2.0);
+    for(int ly = 0; ly < rows; ++ly)
+    {
+        // The G-buffer records hits for the pixel nearest the sample.
+        int j = std::min(y0 + (ly + m / 2) / m, y1 - 1);
+        for(int lx = 0; lx < cols; ++lx)
+        {
+            int i = std::min(x0 + (lx + m / 2) / m, x1 - 1);
+            currentPixel = pixelIndex(i, j);
+            // Seeded by the point's place in the image's lattice, so
+            // neighbouring tiles agree on the points they share.
+            Sampler::current().startSample(x0 * m + lx, y0 * m + ly, 0);
+            // Pixel i covers [i - 0.5, i + 0.5].
+            double x = x0 - 0.5 + lx * step;
+            double y = y0 - 0.5 + ly * step;
+            if(m_settings.jitter)
+            {
+                x = jitter(x);
+                y = jitter(y);
+            }
+            primaryHits = 0;
+            lattice[lx + ly * cols] = tracePrimary(x / double(buffer_width), y / double(buffer_height));
+            latticeHits[lx + ly * cols] = primaryHits;
+        }
+    }
+
+    for(int j = y0; j < y1; ++j)
+    {
+        for(int i = x0; i < x1; ++i)
+        {
+            Vec3d col(0.0f,0.0f,0.0f);
+            double hits = 0.0;
+            int corner = (i - x0) * m + (j - y0) * m * cols;
+            for(int sy = 0; sy <= m; ++sy)
+            {
+                double wy = (sy == 0 || sy == m) ? 0.5 : 1.0;
+                for(int sx = 0; sx <= m; ++sx)
+                {
+                    double wx = (sx == 0 || sx == m) ? 0.5 : 1.0;
+                    col += (wx * wy) * lattice[corner + sx + sy * cols];
+                    hits += (wx * wy) * latticeHits[corner + sx + sy * cols];
+                }
+            }
+            col /= (double)(m * m);
+            m_gbuffer.setSamples(pixelIndex(i, j), (m + 1) * (m + 1));
+            m_frame.set(pixelIndex(i, j), col, hits / (m * m), m * m);
+        }
+    }
+}
+
 void RayTracer::tracePixel( int i, int j )
 {
     Vec3d col(0.0f,0.0f,0.0f);
     if( ! sceneLoaded() ) return;
-        
-    double threshold = 0.001f;
     
     /* Anti-aliasing logic */    
     double x = double(i)/double(buffer_width);
     double y = double(j)/double(buffer_height);
-    int samples = traceUI->m_nSampleSize;; //anti-aliasing sample size
-    double min_x = i - 0.5f;
-    double min_y = j - 0.5f;
-    double resample = 0.5f/(double)(samples/2);
-
-
-    (*it).reserve(samples*samples); //square samples
-    
+    int samples = m_settings.sampleSize; //anti-aliasing sample size
+    currentPixel = pixelIndex(i, j);
+    int used_samples = 1;
+    primaryHits = 0;
 
     if(samples <= 1) //just normally trace
     {
-        col = trace(x,y);
+        Sampler::current().startSample(i, j, 0);
+        col = tracePrimary(x,y);
         //printf("normal traces\n");
     }
+    else if(m_settings.adaptiveSampling) //supersample where the pixel needs it
+    {
+        col = traceAdaptive(i, j, used_samples);
+    }
     else // Anti-aliasing enabled
     {
+        col = supersample(i, j, samples);
+        used_samples = samples*samples;
+    }    
 
-        //printf("antialiasing\n");
-        std::vector<double> x_list;
-        std::vector<double> y_list;
-        x_list.reserve(samples);
-        y_list.reserve(samples);
-        int t = samples - 1;
-        while(t >= 0)
+    m_gbuffer.setSamples(pixelIndex(i, j), used_samples);
+    m_frame.set(pixelIndex(i, j), col, primaryHits / (double)used_samples, used_samples);
+    toneMap(i, j, i + 1, j + 1);
+    return;
+}
+
+// First pass of a reduced resolution render.  Every pixel of the tile gets
+// its primary hit, which is cheap, but only one pixel in each f x f block
+// (f being the reduction) is shaded; the block shows that colour until
+// upsample() fills it in.  Tiles are multiples of every reduction up to
+// TILE_SIZE wide, so blocks never straddle them.
+void RayTracer::traceReducedTile( int x0, int y0, int x1, int y1 )
+{
+    const int f = m_settings.reduction;
+    std::vector<unsigned long long>& rayCounts = threadRayCounts ? *threadRayCounts : m_rayCounts;
+    for(int j = y0; j < y1; ++j)
+    {
+        for(int i = x0; i < x1; ++i)
         {
-            x_list.push_back(min_x+t*resample);
-            y_list.push_back(min_y+t*resample);
-            --t;
+            ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
+            scene->getCamera().rayThrough( double(i)/double(buffer_width), double(j)/double(buffer_height), r );
+            ++rayCounts[0];
+            isect hit;
+            int p = pixelIndex(i, j);
+            if(findAnyHit(r, hit))
+                m_gbuffer.setHit(p, hit.t, hit.N, (-1 * r.getDirection()) * hit.N,
+                                 hit.getMaterial().kd(hit), hit.obj);
+            else
+                m_gbuffer.setMiss(p);
         }
-        if(traceUI->jitter()) //stochastic
+    }
+
+    for(int by = y0; by < y1; by += f)
+    {
+        for(int bx = x0; bx < x1; bx += f)
         {
-            Jitter<double> jitter(resample);
-            std::transform(x_list.begin(), x_list.end(), x_list.begin(), jitter);
-            std::transform(y_list.begin(), y_list.end(), y_list.begin(), jitter);
+            int i = reducedSample(bx, buffer_width);
+            int j = reducedSample(by, buffer_height);
+            currentPixel = pixelIndex(i, j);
+            Sampler::current().startSample(i, j, 0);
+            Vec3d col = tracePrimary(double(i)/double(buffer_width), double(j)/double(buffer_height));
+            m_reduced[bx / f + (by / f) * reducedWidth()] = col;
+            m_gbuffer.setSamples(currentPixel, 1);
+            for(int y = by; y < std::min(by + f, y1); ++y)
+                for(int x = bx; x < std::min(bx + f, x1); ++x)
+                    m_frame.set(pixelIndex(x, y), col, m_gbuffer.hit(pixelIndex(x, y)), 1.0);
         }
+    }
+}
 
-        if(!traceUI->m_bAdaptiveSampling) // if not adaptive, supersample everything
+// The pixel shaded for the block starting at b along an axis of the given
+// size: the block's centre, or the last pixel if the image ends first.
+int RayTracer::reducedSample( int b, int size ) const
+{
+    return std::min(b + m_settings.reduction / 2, size - 1);
+}
+
+int RayTracer::reducedWidth() const
+{
+    return (buffer_width + m_settings.reduction - 1) / m_settings.reduction;
+}
+
+// A quick look at [x0, x1) x [y0, y1): one sample at the centre of each
+// block x block square, filling the square.  Safe to call from several
+// threads at once on different tiles, as is refineTile().
+void RayTracer::tracePreviewTile( int x0, int y0, int x1, int y1, int block )
+{
+    std::vector<unsigned long long> counts(m_rayCounts.size(), 0);
+    threadRayCounts = &counts;
+    ShadingCache::clearThread();
+    for(int by = y0; by < y1; by += block)
+    {
+        for(int bx = x0; bx < x1; bx += block)
         {
-            for(std::vector<double>::iterator itX = x_list.begin();itX!=x_list.end();++itX)
+            int i = std::min(bx + block / 2, x1 - 1);
+            int j = std::min(by + block / 2, y1 - 1);
+            currentPixel = pixelIndex(i, j);
+            Sampler::current().startSample(i, j, 0);
+            primaryHits = 0;
+            Vec3d col = tracePrimary(double(i)/double(buffer_width), double(j)/double(buffer_height));
+            for(int y = by; y < std::min(by + block, y1); ++y)
+                for(int x = bx; x < std::min(bx + block, x1); ++x)
+                    m_frame.set(pixelIndex(x, y), col, primaryHits, 1.0);
+        }
+    }
+    toneMap(x0, y0, x1, y1);
+    threadRayCounts = NULL;
+    mergeRayCounts(counts);
+}
+
+// Trace sample number sample of every pixel in [x0, x1) x [y0, y1).
+// Sample 0 replaces whatever the pixel held and later ones are added to
+// the frame buffer, so a pixel refined n times is the average of n
+// samples.  Jittered, sample 0 goes through the pixel's centre and later
+// ones are its Sobol points; otherwise they are the centres of the
+// n x n strata (n being the sample size) in the adaptive sampler's
+// order.  Samples shared between pixels (-g) need the whole lattice at
+// once, so progressive renders never share them.
+void RayTracer::refineTile( int x0, int y0, int x1, int y1, int sample )
+{
+    const int n = m_settings.sampleSize;
+    const bool uniform = !m_settings.jitter && n > 1;
+    const int stratum = uniform ? stratumOrder(n)[sample] : 0;
+    std::vector<unsigned long long> counts(m_rayCounts.size(), 0);
+    threadRayCounts = &counts;
+    ShadingCache::clearThread();
+    for(int j = y0; j < y1; ++j)
+    {
+        for(int i = x0; i < x1; ++i)
+        {
+            int p = pixelIndex(i, j);
+            currentPixel = p;
+            Sampler& sampler = Sampler::current();
+            sampler.startSample(i, j, sample);
+            double x = i, y = j;
+            if(uniform)
             {
-                for(std::vector<double>::iterator itY = y_list.begin();itY!=y_list.end();++itY)
-                {
-                    col+= trace(*itX/double(buffer_width),*itY/double(buffer_height));
-                }
+                x = i - 0.5 + (stratum % n + 0.5) / n;
+                y = j - 0.5 + (stratum / n + 0.5) / n;
             }
-            col= col / (samples*samples);
-        }       
-        else //supersample important areas doesn't seem to work!
+            else if(sample > 0)
+            {
+                double u, v;
+                sampler.pixelSample(u, v);
+                x = i - 0.5 + u;
+                y = j - 0.5 + v;
+            }
+            primaryHits = 0;
+            Vec3d col = tracePrimary(x / double(buffer_width), y / double(buffer_height));
+            if(sample == 0)
+                m_frame.set(p, col, primaryHits, 1.0);
+            else
+                m_frame.add(p, col, primaryHits, 1.0);
+            m_gbuffer.setSamples(p, sample + 1);
+        }
+    }
+    toneMap(x0, y0, x1, y1);
+    threadRayCounts = NULL;
+    mergeRayCounts(counts);
+}
+
+void RayTracer::mergeRayCounts( const std::vector<unsigned long long>& counts )
+{
+    std::lock_guard<std::mutex> lock(m_rayCountsLock);
+    for(size_t d = 0; d < counts.size(); ++d)
+        m_rayCounts[d] += counts[d];
+}
+
+// Second pass of a reduced resolution render: bring every pixel that
+// wasn't shaded to full resolution with a joint bilateral filter.  A
+// pixel blends the shaded samples of the 2x2 blocks nearest to it,
+// bilinearly, with each weighted down by how far its primary hit is from
+// the pixel's in depth and normal, and dropped if one hit and the other
+// missed.  Pixels none of whose neighbours lie on their surface (thin
+// objects, the far side of a silhouette) are shaded in full instead, so
+// edges stay sharp.  Returns how many were.
+int RayTracer::upsample()
+{
+    static const double MIN_WEIGHT = 0.05;
+    static const double SIGMA_NORMAL = 0.1;
+    static const double SIGMA_DEPTH = 0.02;
+
+    if(!sceneLoaded() || m_settings.reduction <= 1)
+        return 0;
+    const int f = m_settings.reduction;
+    const int cols = reducedWidth();
+    const int rows = (buffer_height + f - 1) / f;
+
+    std::atomic<int> traced(0);
+    parallelChunks(0, buffer_height, [&](int y0, int y1, unsigned int) {
+        std::vector<unsigned long long> counts(m_rayCounts.size(), 0);
+        threadRayCounts = &counts;
+        int fallbacks = 0;
+        for(int j = y0; j < y1; ++j)
         {
-            int squared_samples = samples * samples; // sample squared
-            std::vector<std::pair<double,double> > sample_list;
-            sample_list.reserve(squared_samples);
-            for (std::vector<double>::iterator ix = x_list.begin(); ix != x_list.end(); ix++)
+            // Blocks above and below, and the weight of the lower one.
+            double v = (j - f / 2) / (double)f;
+            int by0 = std::max(0, std::min((int)std::floor(v), rows - 1));
+            int by1 = std::min(by0 + 1, rows - 1);
+            double wy = std::max(0.0, std::min(v - by0, 1.0));
+            for(int i = 0; i < buffer_width; ++i)
             {
-                for(std::vector<double>::iterator iy = y_list.begin(); iy != y_list.end(); iy++)
+                int p = pixelIndex(i, j);
+                if(m_gbuffer.samples(p) > 0)
+                    continue;
+                double u = (i - f / 2) / (double)f;
+                int bx0 = std::max(0, std::min((int)std::floor(u), cols - 1));
+                int bx1 = std::min(bx0 + 1, cols - 1);
+                double wx = std::max(0.0, std::min(u - bx0, 1.0));
+
+                bool hitP = m_gbuffer.hit(p);
+                Vec3d col(0.0f,0.0f,0.0f);
+                double total = 0.0;
+                const int bxs[2] = { bx0, bx1 }, bys[2] = { by0, by1 };
+                const double wxs[2] = { 1.0 - wx, wx }, wys[2] = { 1.0 - wy, wy };
+                for(int sy = 0; sy < 2; ++sy)
                 {
-                    sample_list.push_back(std::make_pair(*ix, *iy));
+                    for(int sx = 0; sx < 2; ++sx)
+                    {
+                        double w = wxs[sx] * wys[sy];
+                        int q = reducedSample(bxs[sx] * f, buffer_width) +
+                                reducedSample(bys[sy] * f, buffer_height) * buffer_width;
+                        if(w <= 0.0 || m_gbuffer.hit(q) != hitP)
+                            continue;
+                        if(hitP)
+                        {
+                            double dn = 1.0 - m_gbuffer.normal(p) * m_gbuffer.normal(q);
+                            double dd = std::fabs(m_gbuffer.depth(p) - m_gbuffer.depth(q)) / m_gbuffer.depth(p);
+                            w *= std::exp(-std::max(dn, 0.0) / SIGMA_NORMAL - dd / SIGMA_DEPTH);
+                        }
+                        col += w * m_reduced[bxs[sx] + bys[sy] * cols];
+                        total += w;
+                    }
                 }
+
+                if(total >= MIN_WEIGHT)
+                    col /= total;
+                else
+                {
+                    currentPixel = p;
+                    Sampler::current().startSample(i, j, 0);
+                    ShadingCache::clearThread();
+                    col = tracePrimary(double(i)/double(buffer_width), double(j)/double(buffer_height));
+                    m_gbuffer.setSamples(p, 1);
+                    ++fallbacks;
+                }
+                m_frame.set(p, col, hitP, 1.0);
             }
-            std::vector<double> sIntensity;
-            sIntensity.reserve(squared_samples);
-            fillRandomIdx(sample_list.begin(),sample_list.end());
-
-            int min_samples = 2;
-            int used_samples = 0;
-            double intensity_sum = 0.0f;
-            for(std::vector<std::pair<double,double> >::iterator it = sample_list.begin();it!=sample_list.end();++it){
-                Vec3d temp = trace((*it).first/double(buffer_width),(*it).second/double(buffer_height));
-                double avg = (temp[0] + temp[1] + temp[2])/3.0f;
-                sIntensity.push_back(avg);
-                col = col + temp;
-                intensity_sum += avg;
-                ++used_samples;
-                if(min_samples <= -1)
+            toneMap(0, j, buffer_width, j + 1);
+        }
+        threadRayCounts = NULL;
+        mergeRayCounts(counts);
+        traced += fallbacks;
+    });
+    return traced;
+}
+
+// Second pass of an edge redraw render, once every tile has been traced
+// at one sample per pixel: supersample, across all worker threads, the
+// pixels that findEdges() flags.  Returns how many there were.
+int RayTracer::resampleEdges()
+{
+    if(!sceneLoaded() || !m_settings.edgeRedraw)
+        return 0;
+    std::vector<int> edges;
+    findEdges(edges);
+    const int samples = m_settings.sampleSize > 1 ? m_settings.sampleSize : EDGE_SAMPLES;
+
+    parallelChunks(0, edges.size(), [&](int b, int e, unsigned int) {
+        std::vector<unsigned long long> counts(m_rayCounts.size(), 0);
+        threadRayCounts = &counts;
+        for(int k = b; k < e; ++k)
+        {
+            int i = edges[k] % buffer_width;
+            int j = edges[k] / buffer_width;
+            currentPixel = edges[k];
+            primaryHits = 0;
+            ShadingCache::clearThread();
+            Vec3d col = supersample(i, j, samples);
+            m_gbuffer.setSamples(edges[k], samples * samples);
+            m_frame.set(edges[k], col, primaryHits / (double)(samples * samples), samples * samples);
+            toneMap(i, j, i + 1, j + 1);
+        }
+        threadRayCounts = NULL;
+        mergeRayCounts(counts);
+    });
+    return edges.size();
+}
+
+// Filter the finished image with the denoiser, guided by the G-buffer.
+// It works on the frame buffer's linear colours, before tone mapping.
+void RayTracer::denoise()
+{
+    if(!sceneLoaded() || !m_settings.denoise)
+        return;
+    int size = buffer_width * buffer_height;
+    std::vector<float> rgb[3];
+    for(int c = 0; c < 3; ++c)
+        rgb[c].resize(size);
+    for(int p = 0; p < size; ++p)
+    {
+        Vec3d col = m_frame.color(p);
+        for(int c = 0; c < 3; ++c)
+            rgb[c][p] = (float)col[c];
+    }
+    m_denoiser.filter(m_gbuffer, rgb);
+    for(int p = 0; p < size; ++p)
+        m_frame.set(p, Vec3d(rgb[0][p], rgb[1][p], rgb[2][p]), m_frame.alpha(p), m_frame.weight(p));
+    toneMapAll();
+}
+
+// Append to edges every pixel that differs from a neighbour in the first
+// pass by more than the thresholds allow: a ray that escaped next to one
+// that didn't; a change of primitive along with a jump in depth (relative
+// to the nearer hit) over the depth threshold, a change of view angle
+// cosine over angle threshold A, or normals whose cosine is under angle
+// threshold B; or, whatever was hit, colours more than EDGE_CONTRAST
+// apart in some channel, which catches shadow and texture edges.  Both
+// pixels of a pair are flagged.
+void RayTracer::findEdges( std::vector<int>& edges ) const
+{
+    static const int EDGE_CONTRAST = 24;    // out of 255
+
+    std::vector<unsigned char> flags(buffer_width * buffer_height, 0);
+    for(int j = 0; j < buffer_height; ++j)
+    {
+        for(int i = 0; i < buffer_width; ++i)
+        {
+            int p = pixelIndex(i, j);
+            int neighbours[2] = { i + 1 < buffer_width ? p + 1 : -1,
+                                  j + 1 < buffer_height ? p + buffer_width : -1 };
+            for(int n = 0; n < 2; ++n)
+            {
+                int q = neighbours[n];
+                if(q < 0 || (flags[p] && flags[q]))
+                    continue;
+                bool edge = false;
+                const unsigned char* a = buffer + p * 3;
+                const unsigned char* b = buffer + q * 3;
+                for(int c = 0; c < 3; ++c)
+                    edge = edge || std::abs(a[c] - b[c]) > EDGE_CONTRAST;
+                if(!edge && m_gbuffer.hit(p) != m_gbuffer.hit(q))
+                    edge = true;
+                else if(!edge && m_gbuffer.hit(p) && m_gbuffer.object(p) != m_gbuffer.object(q))
                 {
-                    double mean = intensity_sum/(double)used_samples;
-                    ZeroMean<double> zero_mean_temp(mean);
-                    std::vector<double> zeroMean(sIntensity);
-                    std::transform(zeroMean.begin(),zeroMean.end(),zeroMean.begin(),zero_mean_temp);
-                    double sum = std::accumulate(zeroMean.begin(),zeroMean.end(), 0.0f);
-                    double tempx = sum/(double)(used_samples -1);
-                    sum = sqrt(tempx);
-                    if(sum < threshold)
-                        break;
+                    float dp = m_gbuffer.depth(p), dq = m_gbuffer.depth(q);
+                    if(std::fabs(dp - dq) > m_settings.depthThreshold * std::min(dp, dq))
+                        edge = true;
+                    else if(std::fabs(m_gbuffer.viewAngle(p) - m_gbuffer.viewAngle(q)) > m_settings.angleThresholdA)
+                        edge = true;
+                    else if(m_gbuffer.normal(p) * m_gbuffer.normal(q) < m_settings.angleThresholdB)
+                        edge = true;
                 }
-                --min_samples;
+                if(edge)
+                    flags[p] = flags[q] = 1;
             }
-            col = col/used_samples;
-        } 
-    }    
+        }
+    }
+    for(int p = 0; p < buffer_width * buffer_height; ++p)
+        if(flags[p])
+            edges.push_back(p);
+}
 
-    unsigned char *pixel = buffer + (i + j * buffer_width) * 3;
-    col = trace(x, y);
-    pixel[0] = (int)(255.0 * col[0]);
-    pixel[1] = (int)(255.0 * col[1]);
-    pixel[2] = (int)(255.0 * col[2]);
-    it++;
-    return;
+// Pixel (i, j) averaged over samples x samples samples: the pixel's Sobol
+// points when jittering, a regular grid otherwise.
+Vec3d RayTracer::supersample( int i, int j, int samples )
+{
+    Vec3d col(0.0f,0.0f,0.0f);
+    double min_x = i - 0.5f;
+    double min_y = j - 0.5f;
+    if(m_settings.jitter) //stochastic
+    {
+        Sampler& sampler = Sampler::current();
+        for(int k = 0; k < samples*samples; ++k)
+        {
+            double u, v;
+            sampler.startSample(i, j, k);
+            sampler.pixelSample(u, v);
+            col += tracePrimary((min_x + u)/double(buffer_width), (min_y + v)/double(buffer_height));
+        }
+    }
+    else
+    {
+        double resample = 0.5f/(double)(samples/2);
+        std::vector<double> x_list;
+        std::vector<double> y_list;
+        x_list.reserve(samples);
+        y_list.reserve(samples);
+        int t = samples - 1;
+        while(t >= 0)
+        {
+            x_list.push_back(min_x+t*resample);
+            y_list.push_back(min_y+t*resample);
+            --t;
+        }
+
+        for(std::vector<double>::iterator itX = x_list.begin();itX!=x_list.end();++itX)
+        {
+            for(std::vector<double>::iterator itY = y_list.begin();itY!=y_list.end();++itY)
+            {
+                Sampler::current().startSample(i, j, (itX - x_list.begin()) * samples + (itY - y_list.begin()));
+                col+= tracePrimary(*itX/double(buffer_width),*itY/double(buffer_height));
+            }
+        }
+    }
+    return col / (samples*samples);
+}
+
+// Adaptive supersampling of pixel (i, j) with up to n x n samples, n
+// being the sample size.  Jittered samples follow the pixel's Sobol
+// points, any prefix of which is well spread; otherwise the centres of
+// the n x n strata are visited in an order that spreads the first few
+// over the whole pixel (see stratumOrder()).  After
+// MIN_ADAPTIVE_SAMPLES the pixel stops as soon as the standard error of
+// its mean brightness is under the adaptive threshold and it doesn't
+// differ from its finished left and upper neighbours by more than
+// CONTRAST_FACTOR times that.  Returns the average of the samples taken
+// and their number in used.
+Vec3d RayTracer::traceAdaptive( int i, int j, int& used )
+{
+    static const int MIN_ADAPTIVE_SAMPLES = 4;
+    static const double CONTRAST_FACTOR = 10.0;
+
+    const int n = m_settings.sampleSize;
+    const std::vector<int>& order = stratumOrder(n);
+    const int maxSamples = n * n;
+    const int minSamples = std::min(MIN_ADAPTIVE_SAMPLES, maxSamples);
+    const double threshold = m_settings.adaptiveThreshold;
+
+    // Brightness of the neighbours already traced, if any.
+    double neighbours[2];
+    int numNeighbours = 0;
+    if(i > 0 && m_gbuffer.samples(pixelIndex(i - 1, j)) > 0)
+        neighbours[numNeighbours++] = pixelBrightness(i - 1, j);
+    if(j > m_firstRow && m_gbuffer.samples(pixelIndex(i, j - 1)) > 0)
+        neighbours[numNeighbours++] = pixelBrightness(i, j - 1);
+
+    Vec3d col(0.0f,0.0f,0.0f);
+    double mean = 0.0;
+    double m2 = 0.0;
+    int count = 0;
+    while(count < maxSamples)
+    {
+        double x, y;
+        Sampler& sampler = Sampler::current();
+        sampler.startSample(i, j, count);
+        if(m_settings.jitter)
+        {
+            double u, v;
+            sampler.pixelSample(u, v);
+            x = i - 0.5 + u;
+            y = j - 0.5 + v;
+        }
+        else
+        {
+            int stratum = order[count];
+            x = i - 0.5 + (stratum % n + 0.5) / n;
+            y = j - 0.5 + (stratum / n + 0.5) / n;
+        }
+        Vec3d sample = tracePrimary(x / double(buffer_width), y / double(buffer_height));
+        col += sample;
+
+        // Welford's running mean and variance of the brightness, as
+        // displayed, so a blown-out pixel needn't converge in the dark.
+        sample.clamp();
+        double brightness = (sample[0] + sample[1] + sample[2]) / 3.0;
+        ++count;
+        double delta = brightness - mean;
+        mean += delta / count;
+        m2 += delta * (brightness - mean);
+
+        if(count < minSamples)
+            continue;
+        double error = std::sqrt(m2 / (count - 1) / count);
+        if(error >= threshold)
+            continue;
+        bool contrast = false;
+        for(int k = 0; k < numNeighbours; ++k)
+            contrast = contrast || std::fabs(mean - neighbours[k]) > CONTRAST_FACTOR * threshold;
+        if(!contrast)
+            break;
+    }
+    used = count;
+    return col / (double)count;
+}
+
+// The n x n strata in the order the adaptive sampler visits them: the
+// one nearest the pixel centre first, then always the one furthest from
+// all those visited so far, so any prefix covers the pixel evenly.  Kept
+// per thread, and only rebuilt when n changes.
+const std::vector<int>& RayTracer::stratumOrder( int n )
+{
+    static thread_local std::vector<int> order;
+    static thread_local std::vector<double> distance;
+    if((int)order.size() == n * n)
+        return order;
+
+    order.clear();
+    distance.assign(n * n, 1.0e308);
+    int next = (n / 2) * n + n / 2;
+    for(int k = 0; k < n * n; ++k)
+    {
+        order.push_back(next);
+        int nx = next % n, ny = next / n;
+        int furthest = -1;
+        for(int s = 0; s < n * n; ++s)
+        {
+            double dx = s % n - nx, dy = s / n - ny;
+            distance[s] = std::min(distance[s], dx * dx + dy * dy);
+            if(distance[s] > 0.0 && (furthest < 0 || distance[s] > distance[furthest]))
+                furthest = s;
+        }
+        next = furthest;
+    }
+    return order;
+}
+
+double RayTracer::pixelBrightness( int i, int j ) const
+{
+    Vec3d col = m_frame.color(pixelIndex(i, j));
+    col.clamp();
+    return (col[0] + col[1] + col[2]) / 3.0;
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
 Vec3d RayTracer::traceRay( const ray& r, const Vec3d& thresh, int depth )
+{
+    return (this->*m_traceKernel)(r, thresh, depth);
+}
+
+// Closest hit along r, through the structure MODE names.
+template<int MODE>
+bool RayTracer::findHit( const ray& r, isect& i )
 {
     bool found = false;
     bool accelerate_failed = false;
-    Vec3d colorC;
+    bool exact = false;
 
-    isect i;
-
-    if(!traceUI->m_accelerate) //If acceleration, use KD tree
+    if(MODE == TRACE_GRID) //If acceleration, use KD tree or grid
+    {
+        found = grid.rayGridTraversal(i, r);
+        exact = true; // the grid never misses, no need to double check
+    }
+    else if(MODE == TRACE_KDTREE)
     {
         found = kdTree.rayTreeTraversal(i, r);
         accelerate_failed = true;
         //printf("using tree\n");
-    }        
-    if (!found) //if not accelerate or kd tree failed, use regular
+    }
+    if (!found && !exact) //if not accelerate or kd tree failed, use regular
     {
         found = scene->intersect( r, i );
         /*if(accelerate_failed)
@@ -179,17 +801,57 @@ Vec3d RayTracer::traceRay( const ray& r, const Vec3d& thresh, int depth )
         if(found && accelerate_failed)
             printf("normal passed too\n");
     }
-        
+    return found;
+}
+
+// findHit() through whichever structure the render traces with.
+bool RayTracer::findAnyHit( const ray& r, isect& i )
+{
+    if(m_traceMode == TRACE_GRID)
+        return findHit<TRACE_GRID>(r, i);
+    if(m_traceMode == TRACE_KDTREE)
+        return findHit<TRACE_KDTREE>(r, i);
+    return findHit<TRACE_BRUTE>(r, i);
+}
+
+template<int MODE, bool NPR, bool BUMP, bool CUBEMAP>
+Vec3d RayTracer::traceRayKernel( const ray& r, const Vec3d& thresh, int depth )
+{
+    std::vector<unsigned long long>& rayCounts = threadRayCounts ? *threadRayCounts : m_rayCounts;
+    ++rayCounts[m_settings.depth - depth];
+    Vec3d colorC;
+
+    isect i;
+    bool found;
+    if(primaryEntry && r.type() == ray::VISIBILITY)
+    {
+        // Replay the hit this sample found last time, or find and keep it.
+        if(primaryEntry->matches(primaryX, primaryY))
+            found = primaryEntry->restore(i);
+        else
+        {
+            found = findHit<MODE>(r, i);
+            primaryEntry->store(primaryX, primaryY, found, i);
+        }
+        primaryEntry = NULL;
+    }
+    else
+        found = findHit<MODE>(r, i);
+
     //printf("depth %d\n", depth);
 
     if(found) //if there is an intersection, process it
     {
         Vec3d point = r.at(i.t);
+        const Material& material = i.getMaterial();
         if(r.type() == ray::VISIBILITY)
-            (*it).push_back(Descriptor(point,(-1 * r.getDirection()) * i.N));
+            ++primaryHits;
+        if(r.type() == ray::VISIBILITY && m_gbuffer.hasGeometry())
+            m_gbuffer.setHit(currentPixel, i.t, i.N, (-1 * r.getDirection()) * i.N, material.kd(i), i.obj);
 
-        const Material& material = i.getMaterial();
-        Vec3d total_intensity = material.shade(scene, r, i); //get initial color of intial endpoint
+        if(ShadowQueue* queue = ShadowQueue::active())
+            queue->setThroughput(thresh);
+        Vec3d total_intensity = material.shade<NPR, BUMP>(scene, r, i, m_settings); //get initial color of intial endpoint
         if(depth < 0) //if 0 levels of recursion, we're done here
             return total_intensity;
 
@@ -202,45 +864,90 @@ Vec3d RayTracer::traceRay( const ray& r, const Vec3d& thresh, int depth )
         dirC = dirA + dirB;
         dirC.normalize();
 
+        Vec3d reflection_intensity(0.0f,0.0f,0.0f);
+        Vec3d refraction_intensity(0.0f,0.0f,0.0f);
+
+        // Secondary rays are only spawned when the weight they'd carry back
+        // to the pixel (the throughput so far times kr or kt) is worth it.
+        Vec3d weight;
+        double survival = 1.0;
+        if(material.hasTerm(Material::TERM_REFLECTIVE))
+        {
+            Vec3d k_r = material.kr(i);
+            weight = thresh;
+            weight %= k_r;
+            if(spawnRay(weight, depth, survival))
+            {
+                ray reflectedRay(point, dirC, ray::REFLECTION);
+                reflection_intensity = k_r;
+                reflection_intensity %=  traceRayKernel<MODE, NPR, BUMP, CUBEMAP>(reflectedRay, weight, depth - 1);
+                if(survival < 1.0)
+                    reflection_intensity /= survival;
+            }
+        }
+
         Vec3d rf_dirA(0.0f,0.0f,0.0f);
         Vec3d rf_dirB(0.0f,0.0f,0.0f);
         Vec3d rf_dirC(0.0f,0.0f,0.0f);
-        bool do_refract = initialize_refractions(r, i, material, dirB, rf_dirA, rf_dirB, rf_dirC);
-
-        ray reflectedRay(point, dirC, ray::REFLECTION);
-        ray refractedRay(point, rf_dirC, ray::REFRACTION);
-
-        Vec3d reflection_intensity = material.kr(i);
-        Vec3d refraction_intensity(0.0f,0.0f,0.0f);
-
-        //printf("Reflection intensity %f,%f,%f\n", reflection_intensity[0], reflection_intensity[1], reflection_intensity[2]);
-        reflection_intensity %=  traceRay(reflectedRay, thresh, depth - 1);
-        if(do_refract)
+        if(material.hasTerm(Material::TERM_TRANSMISSIVE) &&
+           initialize_refractions(r, i, material, dirB, rf_dirA, rf_dirB, rf_dirC))
         {
-            //printf("REFRACTING");
-            refraction_intensity = material.kt(i);
-            refraction_intensity %= traceRay(refractedRay, thresh, depth - 1);
+            Vec3d k_t = material.kt(i);
+            weight = thresh;
+            weight %= k_t;
+            if(spawnRay(weight, depth, survival))
+            {
+                //printf("REFRACTING");
+                ray refractedRay(point, rf_dirC, ray::REFRACTION);
+                refraction_intensity = k_t;
+                refraction_intensity %= traceRayKernel<MODE, NPR, BUMP, CUBEMAP>(refractedRay, weight, depth - 1);
+                if(survival < 1.0)
+                    refraction_intensity /= survival;
+            }
         }
         total_intensity = total_intensity + reflection_intensity + refraction_intensity;
         colorC = total_intensity;
 	} 
     else 
     {
-       if(has_cube_map && cube_map != NULL) //!fix to use checkbox
+       if(CUBEMAP)
         {
-            return cube_map->getColor(r);
+            return m_settings.cubeMap->getColor(r);
         }   
 
 		// No intersection.  This ray travels to infinity, so we color
 		// it according to the background color, which in this (simple) case
 		// is just black.
-        if(r.type() == ray::VISIBILITY)
-            (*it).push_back(Descriptor(Vec3d(0.0f,0.0f,0.0f),0.0f));
+        if(r.type() == ray::VISIBILITY && m_gbuffer.hasGeometry())
+            m_gbuffer.setMiss(currentPixel);
         colorC = Vec3d(0.0, 0.0, 0.0);   
 	}
     return colorC;
 }
 
+// Decide whether a secondary ray carrying the given weight is worth
+// tracing.  Rays whose largest weight component is at or below the
+// threshold are dropped.  From the roulette depth on, the survivors are
+// also culled at random, keeping each with probability equal to that
+// largest component (capped at 1); weight and survival come back scaled
+// so that the caller can divide the result by the survival probability
+// and stay unbiased.
+bool RayTracer::spawnRay(Vec3d& weight, int depth, double& survival) const
+{
+    survival = 1.0;
+    double maxWeight = std::max(weight[0], std::max(weight[1], weight[2]));
+    if(maxWeight <= m_settings.rayThreshold)
+        return false;
+    if(m_settings.rouletteDepth >= 0 && m_settings.depth - depth >= m_settings.rouletteDepth && maxWeight < 1.0)
+    {
+        if(Sampler::current().next() >= maxWeight)
+            return false;
+        survival = maxWeight;
+        weight /= survival;
+    }
+    return true;
+}
+
 bool RayTracer::initialize_refractions(const ray& r, const isect& i, const Material& m, const Vec3d& reflectedDirectionSi, Vec3d& refractedDirectionSt, Vec3d& refractedDirectionCt, Vec3d& refractedDir){
     if((m.kt(i)[0] <= 0.0f&&m.kt(i)[1]<=0.0f&&m.kt(i)[2]<=0.0f) || checkTotalInternal(r,i))
         return false;
@@ -277,7 +984,12 @@ bool RayTracer::checkTotalInternal(const ray &r, const isect &i){
 }
 
 RayTracer::RayTracer()
-	: scene( 0 ), buffer( 0 ), buffer_width( 256 ), buffer_height( 256 ), m_bBufferReady( false )
+	: scene( 0 ), buffer( 0 ), m_bOwnBuffer( true ), buffer_width( 256 ), buffer_height( 256 ),
+	  buffer_rows( 256 ), m_firstRow( 0 ), m_bBufferReady( false ),
+	  m_accelStructure( ACCEL_KDTREE ),
+	  m_traceMode( TRACE_BRUTE ),
+	  m_traceKernel( &RayTracer::traceRayKernel<TRACE_BRUTE, false, false, false> ),
+	  m_rayCounts( m_settings.depth + 2, 0 )
 {
 }
 
@@ -285,14 +997,15 @@ RayTracer::RayTracer()
 RayTracer::~RayTracer()
 {
 	delete scene;
-	delete [] buffer;
+	if( m_bOwnBuffer )
+		delete [] buffer;
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
 	buf = buffer;
 	w = buffer_width;
-	h = buffer_height;
+	h = buffer_rows;
 }
 
 double RayTracer::aspectRatio()
@@ -322,17 +1035,14 @@ bool RayTracer::loadScene( char* fn )
     Parser parser( tokenizer, path );
 	try 
     {
+		kdTree.deleteTree();
+		grid.deleteGrid();
+		m_hitCache.clear();
 		delete scene;
 		scene = 0;
 		scene = parser.parseScene();
         if(traceUI->acceleration())
-        {
-            if(!kdTree.buildTree(scene->beginObjects(),scene->endObjects()))
-            {
-                kdTree.deleteTree();
-                kdTree.buildTree(scene->beginObjects(),scene->endObjects());
-            }
-        }
+            buildAccelerator();
     }
 	catch( SyntaxErrorException& pe ) {
 		traceUI->alert( pe.formattedMessage() );
@@ -356,29 +1066,255 @@ bool RayTracer::loadScene( char* fn )
 	return true;
 }
 
-void RayTracer::descriptor_setup(int w, int h)
+// Build the acceleration structure for the freshly loaded scene.  The
+// scene file's "accelerator" hint wins over the UI setting; ACCEL_AUTO is
+// resolved by chooseAccelerator().
+void RayTracer::buildAccelerator()
+{
+    kdTree.deleteTree();
+    grid.deleteGrid();
+
+    int structure = scene->acceleratorHint() >= 0 ? scene->acceleratorHint() : traceUI->accelStructure();
+    if(structure == ACCEL_AUTO)
+        structure = chooseAccelerator();
+    m_accelStructure = structure;
+
+    if(m_accelStructure == ACCEL_GRID)
+        grid.buildGrid(scene->beginObjects(), scene->endObjects());
+    else
+        kdTree.buildTree(scene->beginObjects(), scene->endObjects(), traceUI->useSurface());
+}
+
+// Pick up TransformNode changes made since the last render (see
+// TransformNode::setLocalTransform) without re-parsing the scene.  Object
+// bounds are recomputed, the grid is simply rebuilt (it's O(N) anyway),
+// and the k-d tree is refit bottom-up; the tree is only rebuilt once the
+// refit has pushed its SAH cost past TraceUI::refitThreshold() times its
+// cost when it was built.
+void RayTracer::updateTransforms()
 {
-    _descriptors.clear();
-    std::vector< std::vector<Descriptor> > temp(w * h);
-    _descriptors = temp;
-    it = _descriptors.begin();
+    if(!sceneLoaded())
+        return;
+    scene->updateBounds();
+    m_hitCache.clear();
+    for(vector<Light*>::const_iterator l = scene->beginLights(); l != scene->endLights(); ++l)
+        (*l)->clearShadowMap();
+    if(!traceUI->acceleration())
+        return;
+
+    if(m_accelStructure == ACCEL_GRID)
+    {
+        grid.deleteGrid();
+        grid.buildGrid(scene->beginObjects(), scene->endObjects());
+    }
+    else if(kdTree.refitTree() > traceUI->refitThreshold())
+    {
+        kdTree.deleteTree();
+        kdTree.buildTree(scene->beginObjects(), scene->endObjects(), traceUI->useSurface());
+    }
 }
 
-void RayTracer::traceSetup( int w, int h )
+// Rough cost model for picking between the k-d tree and the grid.  Only
+// scenes that are rebuilt every frame pay for the build on every image,
+// so static scenes always get the k-d tree.  For dynamic ones we compare
+// build + trace cost, in units of one traversal step, with a primitive
+// test costing about ten steps.  The k-d build sorts every node's objects
+// on three axes per level; the grid build touches each reference twice.
+int RayTracer::chooseAccelerator() const
 {
-	if( buffer_width != w || buffer_height != h || buffer == NULL)
+    if(!traceUI->dynamicScene())
+        return ACCEL_KDTREE;
+
+    double n = std::max(scene->numObjects(), 2);
+    double log2n = std::log(n) / std::log(2.0);
+    int width = traceUI->getSize();
+    int height = (int)(width / scene->getCamera().getAspectRatio() + 0.5);
+    int samples = std::max(traceUI->getSampleSize(), 1);
+    double rays = (double)width * height * samples * samples * (traceUI->getDepth() + 1);
+
+    const double isectCost = 10.0;
+    double kdBuild = 3.0 * n * log2n * std::min(log2n, 15.0);
+    double kdTrace = rays * (log2n + 3.0 * isectCost);
+    double gridBuild = 2.0 * 3.0 * n;
+    double gridTrace = rays * (0.5 * std::cbrt(3.0 * n) * (1.0 + isectCost));
+    return (gridBuild + gridTrace < kdBuild + kdTrace) ? ACCEL_GRID : ACCEL_KDTREE;
+}
+
+// Get ready to render a w x h image.  With rows given, only that many
+// rows are held at a time, starting from the one beginStrip() names, so
+// memory doesn't grow with the image's height; the passes that need the
+// whole image (upsampling, edge redraw, denoising) are then off.
+void RayTracer::traceSetup( int w, int h, int rows )
+{
+	if( rows <= 0 || rows > h )
+		rows = h;
+	buffer_height = h;
+	m_firstRow = 0;
+	if( !m_bOwnBuffer )
+	{
+		buffer = NULL;
+		m_bOwnBuffer = true;
+	}
+	if( buffer_width != w || buffer_rows != rows || buffer == NULL)
 	{
 		buffer_width = w;
-		buffer_height = h;
+		buffer_rows = rows;
 
-		bufferSize = buffer_width * buffer_height * 3;
+		bufferSize = buffer_width * buffer_rows * 3;
 		delete [] buffer;
 		buffer = new unsigned char[ bufferSize ];
 	}
-	memset( buffer, 0, w*h*3 );
-    descriptor_setup(w, h);
+	memset( buffer, 0, bufferSize );
+    captureSettings();
+    m_gbuffer.setup(w, rows, m_settings.edgeRedraw || m_settings.denoise || m_settings.reduction > 1);
+    m_frame.setup(w, rows);
+    if(m_settings.hitCache)
+        m_hitCache.setup(w, h, m_settings.sampleSize * m_settings.sampleSize, scene->getCamera(), m_traceMode);
+    else
+        m_hitCache.clear();
+    if(m_settings.reduction > 1)
+        m_reduced.assign(reducedWidth() * ((h + m_settings.reduction - 1) / m_settings.reduction), Vec3d());
+    else
+        std::vector<Vec3d>().swap(m_reduced);
+    // Primary rays are depth 0; the deepest rays are shaded at depth + 1.
+    m_rayCounts.assign(m_settings.depth + 2, 0);
 	m_bBufferReady = true;
 }
 
+// Trace into pixels, which the caller owns and which must hold the rows
+// traceSetup() set up for, instead of the buffer it allocated.  Lasts
+// until the next traceSetup().
+void RayTracer::useBuffer( unsigned char* pixels )
+{
+	memcpy( pixels, buffer, bufferSize );
+	if( m_bOwnBuffer )
+		delete [] buffer;
+	buffer = pixels;
+	m_bOwnBuffer = false;
+}
+
+// Start on the rows from y0 of a render set up with fewer rows than the
+// image has, dropping the ones held before.
+void RayTracer::beginStrip( int y0 )
+{
+	m_firstRow = y0;
+	memset( buffer, 0, bufferSize );
+	m_gbuffer.setup(buffer_width, buffer_rows, m_gbuffer.hasGeometry());
+	m_frame.setup(buffer_width, buffer_rows);
+}
+
+
+
+
+// Copy the UI's settings for the coming render and pick the trace kernel
+// that matches them.  Nothing below traceSetup() reads traceUI.
+void RayTracer::captureSettings()
+{
+    m_settings = RenderSettings();
+    m_settings.depth = traceUI->getDepth();
+    m_settings.sampleSize = traceUI->getSampleSize();
+    m_settings.jitter = traceUI->jitter();
+    m_settings.adaptiveSampling = traceUI->getAdapativeSampling();
+    m_settings.adaptiveThreshold = traceUI->adaptiveThreshold();
+    m_settings.sharedSamples = traceUI->sharedSamples();
+    m_settings.edgeRedraw = traceUI->edgeRedraw();
+    m_settings.depthThreshold = traceUI->getDepthThreshold();
+    m_settings.angleThresholdA = traceUI->getAngleThresholdA();
+    m_settings.angleThresholdB = traceUI->getAngleThresholdB();
+    m_settings.denoise = traceUI->denoise();
+    m_settings.reduction = std::max(1, std::min(traceUI->reduction(), (int)TILE_SIZE));
+    while(TILE_SIZE % m_settings.reduction != 0)
+        --m_settings.reduction;
+    m_settings.hitCache = traceUI->hitCache() && sceneLoaded();
+    if(buffer_rows < buffer_height)
+    {
+        // Strips can't see their neighbours, and number their pixels
+        // from their first row, so the hit cache can't tell them apart.
+        m_settings.edgeRedraw = false;
+        m_settings.denoise = false;
+        m_settings.reduction = 1;
+        m_settings.hitCache = false;
+    }
+    m_settings.exposure = traceUI->exposure();
+    m_settings.toneMap = traceUI->toneMap();
+    m_settings.accelerate = traceUI->acceleration();
+    m_settings.accelStructure = m_accelStructure;
+    m_settings.nonRealism = traceUI->nonRealism();
+    m_settings.bumpScale = traceUI->getBumpScale();
+    m_settings.rayThreshold = traceUI->rayThreshold();
+    m_settings.rouletteDepth = traceUI->rouletteDepth();
+    m_settings.lightCutoff = traceUI->lightCutoff();
+    m_settings.lightBudget = traceUI->lightBudget();
+    m_settings.occluderCache = traceUI->occluderCache();
+    m_settings.shadowMapRes = traceUI->shadowMapRes();
+    m_settings.shadingCache = traceUI->shadingCache();
+    if(has_cube_map && cube_map != NULL) //!fix to use checkbox
+        m_settings.cubeMap = cube_map;
+    if(sceneLoaded())
+    {
+        m_settings.bumpMapping = scene->hasBumpMaps();
+        m_settings.pixelSpread = scene->getCamera().getV().length() / buffer_height;
+        scene->setRenderSettings(m_settings);
+        OccluderCache::reset();
+        ShadingCache::reset();
+        // Maps survive from render to render until updateTransforms().
+        for(vector<Light*>::const_iterator l = scene->beginLights(); l != scene->endLights(); ++l)
+        {
+            if(m_settings.shadowMapRes > 0)
+                (*l)->buildShadowMap(m_settings.shadowMapRes);
+            else
+                (*l)->clearShadowMap();
+        }
+        ShadowMap::resetStats();
+        if(m_settings.lightCutoff > 0.0 || m_settings.lightBudget > 0)
+            scene->buildLightTree(m_settings.lightCutoff);
+        else
+            scene->clearLightTree();
+    }
+    m_traceMode = selectMode();
+    m_traceKernel = selectKernel();
+}
+
+template<int MODE, bool NPR, bool BUMP>
+RayTracer::TraceKernel RayTracer::selectKernelCubeMap() const
+{
+    if(m_settings.cubeMap != NULL)
+        return &RayTracer::traceRayKernel<MODE, NPR, BUMP, true>;
+    return &RayTracer::traceRayKernel<MODE, NPR, BUMP, false>;
+}
+
+template<int MODE, bool NPR>
+RayTracer::TraceKernel RayTracer::selectKernelBump() const
+{
+    if(m_settings.bumpMapping)
+        return selectKernelCubeMap<MODE, NPR, true>();
+    return selectKernelCubeMap<MODE, NPR, false>();
+}
 
+template<int MODE>
+RayTracer::TraceKernel RayTracer::selectKernelShading() const
+{
+    if(m_settings.nonRealism)
+        return selectKernelBump<MODE, true>();
+    return selectKernelBump<MODE, false>();
+}
 
+// A structure that was never built (acceleration was off when the scene
+// was loaded) falls back to brute force.
+RayTracer::TraceMode RayTracer::selectMode() const
+{
+    if(m_settings.accelerate && m_accelStructure == ACCEL_GRID && grid.isBuilt())
+        return TRACE_GRID;
+    if(m_settings.accelerate && m_accelStructure != ACCEL_GRID && kdTree.isBuilt())
+        return TRACE_KDTREE;
+    return TRACE_BRUTE;
+}
+
+RayTracer::TraceKernel RayTracer::selectKernel() const
+{
+    if(m_traceMode == TRACE_GRID)
+        return selectKernelShading<TRACE_GRID>();
+    if(m_traceMode == TRACE_KDTREE)
+        return selectKernelShading<TRACE_KDTREE>();
+    return selectKernelShading<TRACE_BRUTE>();
+}
@@ -6,21 +6,25 @@
 #include "scene/ray.h"
 #include <vector>
 #include <algorithm>
+#include <mutex>
 #include <numeric>
 #include "kdtree.h"
+#include "grid.h"
+#include "gBuffer.h"
+#include "denoiser.h"
+#include "frameBuffer.h"
+#include "primaryHitCache.h"
+#include "SceneObjects/GeometryTraits.h"
 #include <iterator>
 #include "scene/cubeMap.h"
+#include "scene/renderSettings.h"
+#include "scene/sampler.h"
 
 
 class Scene;
 class RayTracer
 {
 public:
-    struct Descriptor{
-        Vec3d _point;
-        double _viewAngle;
-        Descriptor(Vec3d point = Vec3d(0.0f,0.0f,0.0f), double viewAngle = -1.0f):_point(point),_viewAngle(viewAngle){}};
-
     RayTracer();
     ~RayTracer();
 
@@ -29,10 +33,19 @@ public:
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
-	void traceSetup( int w, int h );
-    void descriptor_setup( int w, int h );
+	void traceSetup( int w, int h, int rows = 0 );
+	void beginStrip( int y0 );
+	void useBuffer( unsigned char* pixels );
 	void tracePixel( int i, int j );
+	void traceTile( int x0, int y0, int x1, int y1 );
+	void tracePreviewTile( int x0, int y0, int x1, int y1, int block );
+	void refineTile( int x0, int y0, int x1, int y1, int sample );
+	int upsample();
+	int resampleEdges();
+	void denoise();
+	enum { TILE_SIZE = 16 };     // side of the tiles traceTile() is meant for
 	bool loadScene( char* fn );
+    void updateTransforms();
 	bool sceneLoaded() { return scene != 0; }
     void setReady( bool ready )
       { m_bBufferReady = ready; }
@@ -45,24 +58,85 @@ public:
     }
     CubeMap *getCubeMap() {return cubemap;}
     bool haveCubeMap() { return cubemap != 0; }
+    int accelStructure() const { return m_accelStructure; }
+    const RenderSettings& renderSettings() const { return m_settings; }
+    // Rays traced in the last render, indexed by depth (0 = primary).
+    const std::vector<unsigned long long>& rayCounts() const { return m_rayCounts; }
+    // Samples traced for each pixel of the last render, row by row.
+    const std::vector<unsigned short>& sampleCounts() const { return m_gbuffer.sampleCounts(); }
+    const GBuffer& gBuffer() const { return m_gbuffer; }
+    // The last render in linear floating point, before tone mapping.
+    const FrameBuffer& frameBuffer() const { return m_frame; }
     
 
 
 private:
-    std::vector<std::vector<Descriptor> > _descriptors;
-    std::vector<std::vector<Descriptor> >::iterator it;
+    // traceRay() specialised on the render settings, so the per-ray code
+    // has no tests on them: how to find hits (TRACE_*), non-photorealistic
+    // shading, bump mapping and the cube map.  traceSetup() picks one.
+    enum TraceMode { TRACE_BRUTE, TRACE_KDTREE, TRACE_GRID };
+    typedef Vec3d (RayTracer::*TraceKernel)( const ray&, const Vec3d&, int );
+    template<int MODE, bool NPR, bool BUMP, bool CUBEMAP>
+    Vec3d traceRayKernel( const ray& r, const Vec3d& thresh, int depth );
+    template<int MODE, bool NPR, bool BUMP>
+    TraceKernel selectKernelCubeMap() const;
+    template<int MODE, bool NPR>
+    TraceKernel selectKernelBump() const;
+    template<int MODE>
+    TraceKernel selectKernelShading() const;
+    TraceMode selectMode() const;
+    TraceKernel selectKernel() const;
+    template<int MODE>
+    bool findHit( const ray& r, isect& i );
+    bool findAnyHit( const ray& r, isect& i );
+    void captureSettings();
+    Vec3d tracePrimary( double x, double y );
+    void traceLatticeTile( int x0, int y0, int x1, int y1 );
+    void traceReducedTile( int x0, int y0, int x1, int y1 );
+    int reducedSample( int b, int size ) const;
+    int reducedWidth() const;
+    void toneMap( int x0, int y0, int x1, int y1 );
+    void mergeRayCounts( const std::vector<unsigned long long>& counts );
+    void toneMapAll();
+    Vec3d supersample( int i, int j, int samples );
+    void findEdges( std::vector<int>& edges ) const;
+    enum { EDGE_SAMPLES = 4 };  // edge samples a side when the sample size is 1
+    Vec3d traceAdaptive( int i, int j, int& used );
+    static const std::vector<int>& stratumOrder( int n );
+    double pixelBrightness( int i, int j ) const;
+    // Index of pixel (i, j) in the rows held.
+    int pixelIndex( int i, int j ) const { return i + (j - m_firstRow) * buffer_width; }
+
+    bool spawnRay(Vec3d& weight, int depth, double& survival) const;
     bool initialize_refractions(const ray&, const isect&, const Material&, const Vec3d&, Vec3d&, Vec3d&, Vec3d&);
 	bool checkTotalInternal(const ray&, const isect&);
+    void buildAccelerator();
+    int chooseAccelerator() const;
     unsigned char *buffer;
+    bool m_bOwnBuffer;          // buffer was allocated by traceSetup()
 	int buffer_width, buffer_height;
+	int buffer_rows;            // rows held: all of them, or a strip's
+	int m_firstRow;             // image row the first one held is
 	int bufferSize;
 	Scene* scene;;
     bool m_bBufferReady;
-    KdTree<Geometry> kdTree;
+    KdTree<Geometry, GeometryTraits> kdTree;
+    UniformGrid<Geometry, GeometryTraits> grid;
+    int m_accelStructure;   // structure built for the current scene
     CubeMap* cubemap;
+    RenderSettings m_settings;  // captured by traceSetup()
+    TraceMode m_traceMode;
+    TraceKernel m_traceKernel;
+    std::vector<unsigned long long> m_rayCounts;
+    std::mutex m_rayCountsLock;     // for threads merging their counts
+    GBuffer m_gbuffer;          // set up by traceSetup()
+    FrameBuffer m_frame;        // likewise; buffer is its tone mapped image
+    Denoiser m_denoiser;
+    PrimaryHitCache m_hitCache;     // primary hits kept from render to render
+    std::vector<Vec3d> m_reduced;   // shaded samples of a reduced resolution render
 };
 
-/* Stochastic logic */
+/* Stochastic logic: draws from the current sample's stream (see Sampler) */
 template<typename T>
 struct Jitter{
     T jitterMax;
@@ -72,11 +146,8 @@ struct Jitter{
     }
     T operator ()(T baseVal)
     {
-        float randVal = (float)rand()/RAND_MAX;
-        int sign = randVal>0.5?1:-1;
-        randVal = (float)rand()/RAND_MAX;
-        randVal*=jitterMax;
-        return (randVal*sign + baseVal);
+        double randVal = 2.0 * Sampler::current().next() - 1.0;
+        return (T)(randVal*jitterMax + baseVal);
     }
 };
 
@@ -84,9 +155,9 @@ template<typename T>
 struct UFRand
 {
     unsigned int operator()(unsigned int val){
-        float randVal = (float)rand()/RAND_MAX;
+        double randVal = Sampler::current().next();
         randVal *= (double)val;
-        return (unsigned int)(randVal + 0.5f);
+        return (unsigned int)(randVal + 0.5);
     }
 };
 
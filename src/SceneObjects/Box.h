@@ -8,6 +8,7 @@ public:
 	Box( Scene *scene, Material *mat )
 		: MaterialSceneObject( scene, mat )
 	{
+		kind = GEOM_BOX;
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
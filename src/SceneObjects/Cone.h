@@ -12,6 +12,7 @@ public:
 			bool cap = false )
 		: MaterialSceneObject( scene, mat )
 	{
+		kind = GEOM_CONE;
 		height = h;
 		b_radius = (br < 0.0f)?(-br):(br);
 		t_radius = (tr < 0.0f)?(-tr):(tr);
@@ -10,6 +10,7 @@ public:
 	Cylinder( Scene *scene, Material *mat )
 		: MaterialSceneObject( scene, mat ), capped( true )
 	{
+		kind = GEOM_CYLINDER;
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
@@ -0,0 +1,44 @@
+#ifndef __GEOMETRY_TRAITS_H__
+#define __GEOMETRY_TRAITS_H__
+
+#include "../scene/scene.h"
+#include "Sphere.h"
+#include "Box.h"
+#include "Square.h"
+#include "Cylinder.h"
+#include "Cone.h"
+#include "trimesh.h"
+
+// Intersector policy for the scene-level KdTree and UniformGrid.  The
+// accelerators only see Geometry*, so rather than a virtual intersect()
+// and a virtual intersectLocal() per candidate, switch once on the
+// object's kind and make a qualified (non-virtual, inlinable) call to the
+// concrete intersectLocal().  Objects of any other type fall back to the
+// virtual path.
+struct GeometryTraits
+{
+	template<typename Shape>
+	static bool intersectAs(const Geometry* g, const ray& r, isect& i) {
+		const Shape* s = static_cast<const Shape*>(g);
+		return g->intersectTransformed(r, i, true,
+			[s](const ray& localRay, isect& li) { return s->Shape::intersectLocal(localRay, li); });
+	}
+
+	static bool intersect(const Geometry* g, const ray& r, isect& i) {
+		switch (g->geometryKind()) {
+		case GEOM_SPHERE:   return intersectAs<Sphere>(g, r, i);
+		case GEOM_BOX:      return intersectAs<Box>(g, r, i);
+		case GEOM_SQUARE:   return intersectAs<Square>(g, r, i);
+		case GEOM_CYLINDER: return intersectAs<Cylinder>(g, r, i);
+		case GEOM_CONE:     return intersectAs<Cone>(g, r, i);
+		case GEOM_TRIMESH:  return intersectAs<Trimesh>(g, r, i);
+		default:            return g->intersect(r, i);
+		}
+	}
+
+	static const BoundingBox& bounds(const Geometry* g) {
+		return g->getBoundingBox();
+	}
+};
+
+#endif // __GEOMETRY_TRAITS_H__
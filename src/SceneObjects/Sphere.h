@@ -10,6 +10,7 @@ public:
 	Sphere( Scene *scene, Material *mat )
 		: MaterialSceneObject( scene, mat )
 	{
+		kind = GEOM_SPHERE;
 	}
     
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
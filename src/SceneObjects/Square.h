@@ -10,6 +10,7 @@ public:
 	Square( Scene *scene, Material *mat )
 		: MaterialSceneObject( scene, mat )
 	{
+		kind = GEOM_SQUARE;
 	}
 
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
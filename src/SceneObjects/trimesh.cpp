@@ -2,10 +2,6 @@
 #include <float.h>
 #include "trimesh.h"
 
-#include "../ui/TraceUI.h"
-
-extern TraceUI* traceUI;
-
 using namespace std;
 
 Trimesh::~Trimesh()
@@ -62,7 +58,7 @@ bool Trimesh::intersectLocal(const ray&r, isect&i) const
 	double tmax = 0.0;
 	typedef Faces::const_iterator iter;
     bool have_one = false;
-    if(traceUI->acceleration())
+    if(scene->renderSettings().accelerate && kdTree.isBuilt())
         have_one = const_cast<Trimesh*>(this)->kdTree.rayTreeTraversal(i,r);
     else
         for( iter j = faces.begin(); j != faces.end(); ++j ) {
@@ -80,9 +76,9 @@ bool Trimesh::intersectLocal(const ray&r, isect&i) const
 	return have_one;
 }
 
-void Trimesh::constructKDTree()
+void Trimesh::constructKDTree(bool useSurface)
 {
-    this->kdTree.buildTree(this->faces.begin(),this->faces.end());
+    this->kdTree.buildTree(this->faces.begin(),this->faces.end(),useSurface);
 }
 
 
@@ -147,6 +143,7 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
         planeNormal.normalize();
     }
 
+    i.setObject(this);
     i.setN(planeNormal);
     i.setT(intersectionWt);
     i.setBary(barycentricCords);
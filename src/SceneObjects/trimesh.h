@@ -19,6 +19,7 @@ int updateCordsToKeep(int normDim, T planeNormal){
     return cordToDrop;}
 
 class TrimeshFace;
+struct FaceTraits;
 class Trimesh : public MaterialSceneObject
 {
     friend class TrimeshFace;
@@ -32,7 +33,7 @@ class Trimesh : public MaterialSceneObject
     Normals normals;
     Materials materials;
 	BoundingBox localBounds;
-    KdTree<TrimeshFace> kdTree;
+    KdTree<TrimeshFace, FaceTraits> kdTree;
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat), 
@@ -41,6 +42,7 @@ public:
     {
       this->transform = transform;
       vertNorms = false;
+      kind = GEOM_TRIMESH;
     }
 
     bool vertNorms;
@@ -59,7 +61,7 @@ public:
     
     void generateNormals();
 
-    void constructKDTree();
+    void constructKDTree(bool useSurface);
 
     bool hasBoundingBoxCapability() const { return true; }
       
@@ -154,4 +156,14 @@ public:
 
  };
 
+// Kd-tree policy for the faces of a mesh: faces are always tested in the
+// mesh's local space, so go straight to the triangle test.
+struct FaceTraits
+{
+    static bool intersect(const TrimeshFace* f, const ray& r, isect& i) {
+        return f->TrimeshFace::intersectLocal(r, i); }
+    static const BoundingBox& bounds(const TrimeshFace* f) {
+        return f->localbounds; }
+};
+
 #endif // TRIMESH_H__
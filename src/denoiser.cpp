@@ -0,0 +1,140 @@
+#include "denoiser.h"
+#include "gBuffer.h"
+#include "parallel.h"
+#include <cmath>
+
+// B3-spline taps, [1 4 6 4 1] / 16.
+static const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+static inline float luminance(const std::vector<float> rgb[3], int p)
+{
+    return 0.2126f * rgb[0][p] + 0.7152f * rgb[1][p] + 0.0722f * rgb[2][p];
+}
+
+Denoiser::Denoiser()
+    : iterations(5), sigmaColor(4.0f), sigmaNormal(0.1f), sigmaDepth(0.01f), sigmaAlbedo(0.1f)
+{
+}
+
+void Denoiser::filter(const GBuffer& gbuffer, std::vector<float> rgb[3])
+{
+    int width = gbuffer.width();
+    int height = gbuffer.height();
+    for(int c = 0; c < 4; ++c)
+    {
+        _planes[0][c].resize(width * height);
+        _planes[1][c].resize(width * height);
+    }
+    for(int c = 0; c < 3; ++c)
+        _planes[0][c].swap(rgb[c]);
+    parallelChunks(0, height, [&](int y0, int y1, unsigned int) {
+        estimateVariance(gbuffer, _planes[0], y0, y1);
+    });
+
+    int in = 0;
+    for(int i = 0; i < iterations; ++i)
+    {
+        int step = 1 << i;
+        parallelChunks(0, height, [&](int y0, int y1, unsigned int) {
+            filterRows(gbuffer, _planes[in], _planes[1 - in], step, y0, y1);
+        });
+        in = 1 - in;
+    }
+    for(int c = 0; c < 3; ++c)
+        rgb[c].swap(_planes[in][c]);
+}
+
+// Weight of pixel q's features relative to pixel p's, for taps step
+// pixels apart: everything but colour.
+float Denoiser::featureWeight(const GBuffer& gbuffer, int p, int q, int step) const
+{
+    bool hitP = gbuffer.hit(p);
+    bool hitQ = gbuffer.hit(q);
+    if(hitP != hitQ)
+        return 0.0f;
+    if(!hitP)
+        return 1.0f;
+    float dn = 1.0f - (float)(gbuffer.normal(p) * gbuffer.normal(q));
+    float depthP = gbuffer.depth(p);
+    float dd = std::fabs(depthP - gbuffer.depth(q)) / depthP;
+    Vec3d da = gbuffer.albedo(p) - gbuffer.albedo(q);
+    return std::exp(-(std::max(dn, 0.0f) / sigmaNormal + dd / (sigmaDepth * step) +
+                      (float)(da * da) / (sigmaAlbedo * sigmaAlbedo)));
+}
+
+// With one sample a pixel there is no variance to measure per pixel, so
+// take the variance of luminance over the 5x5 pixels around each one on
+// the same surface.
+void Denoiser::estimateVariance(const GBuffer& gbuffer, std::vector<float> planes[4], int y0, int y1) const
+{
+    const int width = gbuffer.width();
+    const int height = gbuffer.height();
+    for(int y = y0; y < y1; ++y)
+    {
+        for(int x = 0; x < width; ++x)
+        {
+            int p = x + y * width;
+            float sum = 0.0f, sumSquares = 0.0f, total = 0.0f;
+            for(int qy = std::max(y - 2, 0); qy <= std::min(y + 2, height - 1); ++qy)
+            {
+                for(int qx = std::max(x - 2, 0); qx <= std::min(x + 2, width - 1); ++qx)
+                {
+                    int q = qx + qy * width;
+                    float w = featureWeight(gbuffer, p, q, 1);
+                    float l = luminance(planes, q);
+                    sum += w * l;
+                    sumSquares += w * l * l;
+                    total += w;
+                }
+            }
+            float mean = sum / total;
+            planes[3][p] = std::max(sumSquares / total - mean * mean, 0.0f);
+        }
+    }
+}
+
+// One a-trous iteration.  The colour weight compares luminances against
+// the noise expected at p (its standard deviation), and the variance is
+// filtered along with the colour, with squared weights, so the tolerance
+// tightens as the image gets cleaner.
+void Denoiser::filterRows(const GBuffer& gbuffer, const std::vector<float> in[4],
+                          std::vector<float> out[4], int step, int y0, int y1) const
+{
+    const int width = gbuffer.width();
+    const int height = gbuffer.height();
+    for(int y = y0; y < y1; ++y)
+    {
+        for(int x = 0; x < width; ++x)
+        {
+            int p = x + y * width;
+            float luminanceP = luminance(in, p);
+            float colorScale = 1.0f / (sigmaColor * std::sqrt(in[3][p]) + 1.0e-4f);
+            float r = 0.0f, g = 0.0f, b = 0.0f, variance = 0.0f, total = 0.0f;
+            for(int ty = 0; ty < 5; ++ty)
+            {
+                int qy = y + (ty - 2) * step;
+                if(qy < 0 || qy >= height)
+                    continue;
+                for(int tx = 0; tx < 5; ++tx)
+                {
+                    int qx = x + (tx - 2) * step;
+                    if(qx < 0 || qx >= width)
+                        continue;
+                    int q = qx + qy * width;
+                    float w = kernel[tx] * kernel[ty] * featureWeight(gbuffer, p, q, step) *
+                              std::exp(-std::fabs(luminance(in, q) - luminanceP) * colorScale);
+                    r += w * in[0][q];
+                    g += w * in[1][q];
+                    b += w * in[2][q];
+                    variance += w * w * in[3][q];
+                    total += w;
+                }
+            }
+            // The centre tap always counts, so total is never zero.
+            out[0][p] = r / total;
+            out[1][p] = g / total;
+            out[2][p] = b / total;
+            out[3][p] = variance / (total * total);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+#include <vector>
+
+class GBuffer;
+
+/* Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), for renders
+   with too few samples per pixel.
+
+   Each iteration blurs the image with a 5x5 B3-spline kernel whose taps
+   are spread 2^i pixels apart, so five iterations cover a 125 pixel wide
+   footprint for 125 taps a pixel.  Every tap is weighted down by how much
+   the two pixels differ in normal, depth and diffuse albedo, read from the
+   G-buffer of the same render, so the blur stays within a surface and
+   stops at geometry and texture edges.  It is also weighted down by the
+   difference in luminance, measured against the pixel's noise as in SVGF
+   (Schied et al. 2017), which keeps shadow edges.  Pixels whose primary
+   ray escaped never mix with pixels that hit something.
+
+   The image is kept as one float plane per channel, and rows are shared
+   out across worker threads. */
+class Denoiser
+{
+public:
+    Denoiser();
+
+    // Filter the image in rgb (planes of gbuffer.width() x gbuffer.height()
+    // floats) in place.  The G-buffer must have its geometry planes.
+    void filter(const GBuffer& gbuffer, std::vector<float> rgb[3]);
+
+    int iterations;
+    float sigmaColor;       // luminance difference, in standard deviations, at which a tap falls to 1/e
+    float sigmaNormal;      // 1 - cosine between normals, likewise
+    float sigmaDepth;       // relative depth difference per pixel of offset
+    float sigmaAlbedo;      // albedo distance
+
+private:
+    float featureWeight(const GBuffer& gbuffer, int p, int q, int step) const;
+    void estimateVariance(const GBuffer& gbuffer, std::vector<float> planes[4], int y0, int y1) const;
+    void filterRows(const GBuffer& gbuffer, const std::vector<float> in[4],
+                    std::vector<float> out[4], int step, int y0, int y1) const;
+
+    // Two sets of red, green, blue and variance planes, filtered from one
+    // into the other.
+    std::vector<float> _planes[2][4];
+};
+
+#endif // DENOISER_H
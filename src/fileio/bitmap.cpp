@@ -99,14 +99,34 @@ unsigned char *readBMP(const char *fname, int& width, int& height)
  
 void writeBMP(const char *iname, int width, int height, unsigned char *data) 
 { 
+	FILE *foo = openBMP(iname, width, height);
+	if (!foo)
+		return;
+	writeBMPRows(foo, width, height, data);
+	fclose(foo);
+}
+
+bool fitsBMP(int width, int height)
+{
+	unsigned long long bytes = ((unsigned long long)width * 3 + 3) & ~3ULL;
+	return 14 + sizeof(BMP_BITMAPINFOHEADER) + bytes * height <= 0xffffffffULL;
+}
+
+// Write the headers of a width x height BMP, leaving the file ready for
+// its rows, bottom first.
+FILE *openBMP(const char *iname, int width, int height)
+{
+	if (!fitsBMP(width, height))
+		return NULL;
+
 	int bytes, pad;
 	bytes = width * 3;
 	pad = (bytes%4) ? 4-(bytes%4) : 0;
 	bytes += pad;
-	bytes *= height;
 
 	bmfh.bfType = 0x4d42;    // "BM"
-	bmfh.bfSize = sizeof(BMP_BITMAPFILEHEADER) + sizeof(BMP_BITMAPINFOHEADER) + bytes;
+	bmfh.bfSize = sizeof(BMP_BITMAPFILEHEADER) + sizeof(BMP_BITMAPINFOHEADER) + 
+				  (BMP_DWORD)bytes * height;
 	bmfh.bfReserved1 = 0;
 	bmfh.bfReserved2 = 0;
 	bmfh.bfOffBits = /*hack sizeof(BMP_BITMAPFILEHEADER)=14, sizeof doesn't work?*/ 
@@ -125,6 +145,8 @@ void writeBMP(const char *iname, int width, int height, unsigned char *data)
 	bmih.biClrImportant = 0;
 
 	FILE *foo=fopen(iname, "wb"); 
+	if (!foo)
+		return NULL;
 
 	//	fwrite(&bmfh, sizeof(BMP_BITMAPFILEHEADER), 1, foo);
 	fwrite( &(bmfh.bfType), 2, 1, foo); 
@@ -134,22 +156,27 @@ void writeBMP(const char *iname, int width, int height, unsigned char *data)
 	fwrite( &(bmfh.bfOffBits), 4, 1, foo); 
 
 	fwrite(&bmih, sizeof(BMP_BITMAPINFOHEADER), 1, foo); 
-
-	bytes /= height;
-	unsigned char* scanline = new unsigned char [bytes];
-	for ( int j = 0; j < height; ++j )
+	return foo;
+}
+
+// Append rows of RGB data to a BMP begun by openBMP().
+void writeBMPRows(FILE *foo, int width, int rows, const unsigned char *data)
+{
+	int bytes = width * 3;
+	int pad = (bytes%4) ? 4-(bytes%4) : 0;
+	unsigned char* scanline = new unsigned char [bytes + pad];
+	memset( scanline + bytes, 0, pad );
+	for ( int j = 0; j < rows; ++j )
 	{
-		memcpy( scanline, data + j*3*width, bytes );
+		const unsigned char* row = data + (size_t)j*bytes;
 		for ( int i = 0; i < width; ++i )
 		{
-			unsigned char temp = scanline[i*3];
-			scanline[i*3] = scanline[i*3+2];
-			scanline[i*3+2] = temp;
+			scanline[i*3] = row[i*3+2];
+			scanline[i*3+1] = row[i*3+1];
+			scanline[i*3+2] = row[i*3];
 		}
-		fwrite( scanline, bytes, 1, foo);
+		fwrite( scanline, bytes + pad, 1, foo);
 	}
 
 	delete [] scanline;
-
-	fclose(foo);
 } 
\ No newline at end of file
@@ -43,5 +43,13 @@ typedef struct {
 extern unsigned char *readBMP(const char *fname, int& width, int& height);
 extern void writeBMP(const char *iname, int width, int height, unsigned char *data); 
 
+// writeBMP() a few rows at a time: openBMP() writes the headers, then
+// writeBMPRows() appends rows bottom to top until all height are written.
+extern FILE *openBMP(const char *iname, int width, int height);
+// Whether a width x height BMP stays under the 4 GiB its 32-bit size field
+// can describe; openBMP() refuses larger ones.
+extern bool fitsBMP(int width, int height);
+extern void writeBMPRows(FILE *file, int width, int rows, const unsigned char *data);
+
 #endif
 
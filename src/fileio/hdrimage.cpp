@@ -0,0 +1,110 @@
+//
+// hdrimage.cpp
+//
+// PFM and OpenEXR output.  Both are written little endian, as the BMP
+// writer assumes of the machine.
+//
+
+#include "hdrimage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+bool writePFM(const char *iname, int width, int height, const float *rgba)
+{
+	FILE *file = fopen(iname, "wb");
+	if (!file)
+		return false;
+
+	// A negative scale marks the data little endian.  Rows run bottom to
+	// top, like ours.
+	fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+	std::vector<float> scanline(width * 3);
+	for (int j = 0; j < height; ++j)
+	{
+		const float *row = rgba + j * width * 4;
+		for (int i = 0; i < width; ++i)
+			for (int c = 0; c < 3; ++c)
+				scanline[i * 3 + c] = row[i * 4 + c];
+		fwrite(&scanline[0], sizeof(float), scanline.size(), file);
+	}
+	return fclose(file) == 0;
+}
+
+// An EXR header attribute: name, type, size and value.
+static void writeAttribute(FILE *file, const char *name, const char *type,
+	int size, const void *value)
+{
+	fwrite(name, 1, strlen(name) + 1, file);
+	fwrite(type, 1, strlen(type) + 1, file);
+	fwrite(&size, 4, 1, file);
+	fwrite(value, 1, size, file);
+}
+
+bool writeEXR(const char *iname, int width, int height, const float *rgba)
+{
+	FILE *file = fopen(iname, "wb");
+	if (!file)
+		return false;
+
+	const int magic = 20000630;
+	const int version = 2;		// single part scanline image
+	fwrite(&magic, 4, 1, file);
+	fwrite(&version, 4, 1, file);
+
+	// Channels must be listed in alphabetical order, as they are stored.
+	const char names[4] = { 'A', 'B', 'G', 'R' };
+	const int source[4] = { 3, 2, 1, 0 };	// their index in rgba
+	std::vector<unsigned char> channels;
+	for (int c = 0; c < 4; ++c)
+	{
+		// name, pixel type (2 = FLOAT), pLinear and three reserved
+		// bytes, x and y sampling.
+		const int fields[4] = { 2, 0, 1, 1 };
+		channels.push_back(names[c]);
+		channels.push_back(0);
+		const unsigned char *bytes = (const unsigned char *)fields;
+		channels.insert(channels.end(), bytes, bytes + sizeof(fields));
+	}
+	channels.push_back(0);
+	writeAttribute(file, "channels", "chlist", channels.size(), &channels[0]);
+
+	const unsigned char compression = 0;	// NO_COMPRESSION
+	const unsigned char lineOrder = 0;		// INCREASING_Y
+	const int window[4] = { 0, 0, width - 1, height - 1 };
+	const float aspect = 1.0f;
+	const float center[2] = { 0.0f, 0.0f };
+	writeAttribute(file, "compression", "compression", 1, &compression);
+	writeAttribute(file, "dataWindow", "box2i", 16, window);
+	writeAttribute(file, "displayWindow", "box2i", 16, window);
+	writeAttribute(file, "lineOrder", "lineOrder", 1, &lineOrder);
+	writeAttribute(file, "pixelAspectRatio", "float", 4, &aspect);
+	writeAttribute(file, "screenWindowCenter", "v2f", 8, center);
+	writeAttribute(file, "screenWindowWidth", "float", 4, &aspect);
+	fputc(0, file);
+
+	// Uncompressed, every scanline is its own chunk: its y, the size of
+	// its data, then each channel's row in turn.
+	const int lineSize = width * 4 * sizeof(float);
+	unsigned long long offset = ftell(file) + (unsigned long long)height * 8;
+	for (int y = 0; y < height; ++y)
+	{
+		fwrite(&offset, 8, 1, file);
+		offset += 8 + lineSize;
+	}
+
+	std::vector<float> scanline(width * 4);
+	for (int y = 0; y < height; ++y)
+	{
+		// EXR rows run top to bottom.
+		const float *row = rgba + (height - 1 - y) * width * 4;
+		for (int c = 0; c < 4; ++c)
+			for (int i = 0; i < width; ++i)
+				scanline[c * width + i] = row[i * 4 + source[c]];
+		fwrite(&y, 4, 1, file);
+		fwrite(&lineSize, 4, 1, file);
+		fwrite(&scanline[0], sizeof(float), scanline.size(), file);
+	}
+	return fclose(file) == 0;
+}
@@ -0,0 +1,21 @@
+//
+// hdrimage.h
+//
+// Floating point image output, for renders kept in high dynamic range.
+//
+
+#ifndef HDRIMAGE_H
+#define HDRIMAGE_H
+
+// Both take width x height pixels of four floats (red, green, blue, alpha),
+// rows bottom to top as in the frame buffer, and return false if the file
+// couldn't be written.
+
+// Portable float map: three channel, little endian, no alpha.
+extern bool writePFM(const char *iname, int width, int height, const float *rgba);
+
+// OpenEXR: uncompressed 32-bit float scanlines with an alpha channel,
+// which any EXR reader accepts.
+extern bool writeEXR(const char *iname, int width, int height, const float *rgba);
+
+#endif
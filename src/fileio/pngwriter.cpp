@@ -0,0 +1,303 @@
+//
+// pngwriter.cpp
+//
+// Strip-parallel PNG encoding with zlib.
+//
+
+#include "pngwriter.h"
+#include "../parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "zlib.h"
+
+// PNG integers are big endian.
+static void putInt(unsigned char *out, unsigned long v)
+{
+	out[0] = (unsigned char)(v >> 24);
+	out[1] = (unsigned char)(v >> 16);
+	out[2] = (unsigned char)(v >> 8);
+	out[3] = (unsigned char)v;
+}
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Filter row with each of the five PNG filters that it may use (only None
+// and Sub without the row above) and keep the one whose output has the
+// smallest sum of absolute values, the heuristic libpng uses.  out gets
+// the filter type byte then the row.
+static void filterRow(const unsigned char *row, const unsigned char *above, int bytes,
+	unsigned char *out, std::vector<unsigned char> &scratch)
+{
+	const int bpp = 3;
+	scratch.resize(bytes);
+	long best = -1;
+	int filters = above ? 5 : 2;
+	for (int f = 0; f < filters; ++f)
+	{
+		long sum = 0;
+		for (int k = 0; k < bytes; ++k)
+		{
+			int a = k >= bpp ? row[k - bpp] : 0;
+			int b = above ? above[k] : 0;
+			int c = (above && k >= bpp) ? above[k - bpp] : 0;
+			int predicted = 0;
+			switch (f)
+			{
+				case 1: predicted = a; break;
+				case 2: predicted = b; break;
+				case 3: predicted = (a + b) / 2; break;
+				case 4: predicted = paeth(a, b, c); break;
+			}
+			unsigned char v = (unsigned char)(row[k] - predicted);
+			scratch[k] = v;
+			sum += v < 128 ? v : 256 - v;
+		}
+		if (best < 0 || sum < best)
+		{
+			best = sum;
+			out[0] = (unsigned char)f;
+			memcpy(out + 1, &scratch[0], bytes);
+		}
+	}
+}
+
+PngWriter::PngWriter()
+	: _file(NULL), _ok(false), _width(0), _height(0), _rowsPerStrip(0), _rgb(NULL),
+	_written(0), _adler(1), _closing(false)
+{
+}
+
+PngWriter::~PngWriter()
+{
+	if (_file)
+		close();
+}
+
+bool PngWriter::open(const char *iname, int width, int height, const unsigned char *rgb,
+	int rowsPerStrip)
+{
+	_file = fopen(iname, "wb");
+	if (!_file)
+		return false;
+	_ok = true;
+	_width = width;
+	_height = height;
+	_rgb = rgb;
+	_rowsPerStrip = rowsPerStrip;
+	_written = 0;
+	_adler = adler32(0L, Z_NULL, 0);
+	_closing = false;
+
+	int strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+	_strips.assign(strips, Strip());
+	for (int s = 0; s < strips; ++s)
+	{
+		_strips[s].rowsLeft = std::min(rowsPerStrip, height - s * rowsPerStrip);
+		_strips[s].compressed = false;
+	}
+
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	fwrite(signature, 1, 8, _file);
+	// IHDR: size, 8 bits a channel, truecolour, deflate, adaptive
+	// filtering, no interlace.
+	unsigned char header[13];
+	putInt(header, width);
+	putInt(header + 4, height);
+	header[8] = 8;
+	header[9] = 2;
+	header[10] = header[11] = header[12] = 0;
+	writeChunk("IHDR", header, 13);
+
+	unsigned int workers = std::min(numWorkerThreads(), (unsigned int)strips);
+	for (unsigned int w = 0; w < workers; ++w)
+		_workers.push_back(std::thread(&PngWriter::work, this));
+	return true;
+}
+
+void PngWriter::rowsDone(int y0, int y1)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	for (int y = y0; y < y1; ++y)
+	{
+		// The file runs top to bottom.
+		int s = (_height - 1 - y) / _rowsPerStrip;
+		if (--_strips[s].rowsLeft == 0)
+			stripDone(s);
+	}
+}
+
+void PngWriter::addRows(const unsigned char *rows, int y0, int y1)
+{
+	const int bytes = _width * 3;
+	std::unique_lock<std::mutex> lock(_lock);
+	while (_queue.size() > _workers.size())
+		_taken.wait(lock);
+	for (int y = y0; y < y1; ++y)
+	{
+		int r = _height - 1 - y;
+		Strip &strip = _strips[r / _rowsPerStrip];
+		int first = r / _rowsPerStrip * _rowsPerStrip;
+		if (strip.rgb.empty())
+			strip.rgb.resize(std::min(_rowsPerStrip, _height - first) * bytes);
+		memcpy(&strip.rgb[(r - first) * bytes], rows + (y - y0) * bytes, bytes);
+		if (--strip.rowsLeft == 0)
+			stripDone(r / _rowsPerStrip);
+	}
+}
+
+// Queue strip s for a worker.  Called with _lock held.
+void PngWriter::stripDone(int s)
+{
+	_queue.push_back(s);
+	_ready.notify_one();
+}
+
+bool PngWriter::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(_lock);
+		_closing = true;
+	}
+	_ready.notify_all();
+	for (std::vector<std::thread>::iterator t = _workers.begin(); t != _workers.end(); ++t)
+		t->join();
+	_workers.clear();
+
+	// Strips whose rows were never reported are left out, and the file
+	// is cut short.
+	if (_written < (int)_strips.size())
+		_ok = false;
+	else
+		writeChunk("IEND", NULL, 0);
+	bool ok = fclose(_file) == 0 && _ok;
+	_file = NULL;
+	return ok;
+}
+
+void PngWriter::work()
+{
+	for (;;)
+	{
+		int s;
+		{
+			std::unique_lock<std::mutex> lock(_lock);
+			while (_queue.empty() && !_closing)
+				_ready.wait(lock);
+			if (_queue.empty())
+				return;
+			s = _queue.front();
+			_queue.pop_front();
+		}
+		_taken.notify_one();
+		compress(s);
+		std::lock_guard<std::mutex> lock(_lock);
+		_strips[s].compressed = true;
+		writeReady();
+	}
+}
+
+void PngWriter::compress(int s)
+{
+	Strip &strip = _strips[s];
+	const int bytes = _width * 3;
+	const int first = s * _rowsPerStrip;
+	const int rows = std::min(_rowsPerStrip, _height - first);
+
+	std::vector<unsigned char> filtered(rows * (bytes + 1));
+	std::vector<unsigned char> scratch;
+	for (int r = 0; r < rows; ++r)
+	{
+		const unsigned char *row, *above;
+		if (_rgb)
+		{
+			int y = _height - 1 - (first + r);
+			row = _rgb + (size_t)y * bytes;
+			above = r > 0 ? row + bytes : NULL;
+		}
+		else
+		{
+			row = &strip.rgb[r * bytes];
+			above = r > 0 ? row - bytes : NULL;
+		}
+		filterRow(row, above, bytes, &filtered[r * (bytes + 1)], scratch);
+	}
+	std::vector<unsigned char>().swap(strip.rgb);
+	strip.filteredSize = filtered.size();
+	strip.adler = adler32(adler32(0L, Z_NULL, 0), &filtered[0], filtered.size());
+
+	// Raw deflate, no zlib header; all strips but the last end on a byte
+	// boundary without closing the stream.
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	strip.data.resize(deflateBound(&z, filtered.size()) + 16);
+	z.next_in = &filtered[0];
+	z.avail_in = filtered.size();
+	z.next_out = &strip.data[0];
+	z.avail_out = strip.data.size();
+	bool last = s == (int)_strips.size() - 1;
+	deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+	strip.data.resize(z.total_out);
+	deflateEnd(&z);
+}
+
+// Write every compressed strip that is next in the file.  Called with
+// _lock held.
+void PngWriter::writeReady()
+{
+	while (_written < (int)_strips.size() && _strips[_written].compressed)
+	{
+		Strip &strip = _strips[_written];
+		std::vector<unsigned char> &data = strip.data;
+		if (_written == 0)
+		{
+			// zlib header: deflate with a 32K window, default level.
+			static const unsigned char header[2] = { 0x78, 0x9c };
+			data.insert(data.begin(), header, header + 2);
+		}
+		_adler = adler32_combine(_adler, strip.adler, strip.filteredSize);
+		if (_written == (int)_strips.size() - 1)
+		{
+			unsigned char trailer[4];
+			putInt(trailer, _adler);
+			data.insert(data.end(), trailer, trailer + 4);
+		}
+		writeChunk("IDAT", &data[0], data.size());
+		std::vector<unsigned char>().swap(data);
+		++_written;
+	}
+}
+
+void PngWriter::writeChunk(const char *type, const unsigned char *data, unsigned int size)
+{
+	unsigned char word[4];
+	putInt(word, size);
+	fwrite(word, 1, 4, _file);
+	fwrite(type, 1, 4, _file);
+	unsigned long crc = crc32(0L, (const Bytef *)type, 4);
+	if (size)
+	{
+		fwrite(data, 1, size, _file);
+		crc = crc32(crc, data, size);
+	}
+	putInt(word, crc);
+	if (fwrite(word, 1, 4, _file) != 4)
+		_ok = false;
+}
+
+bool writePNG(const char *iname, int width, int height, const unsigned char *data)
+{
+	PngWriter writer;
+	if (!writer.open(iname, width, height, data))
+		return false;
+	writer.rowsDone(0, height);
+	return writer.close();
+}
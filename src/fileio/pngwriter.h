@@ -0,0 +1,93 @@
+//
+// pngwriter.h
+//
+// PNG output, deflated in strips on worker threads.
+//
+
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Writes an 8-bit RGB image (rows bottom to top, as the ray tracer keeps
+// them) as a PNG while it is still being rendered.
+//
+// The image is cut into strips of rowsPerStrip rows, each filtered and
+// deflated on its own, so strips compress in parallel: a strip is handed
+// to a worker as soon as the caller reports all its rows finished.  The
+// strips' raw deflate streams are flushed to a byte boundary and
+// concatenated into the one zlib stream PNG wants, their checksums being
+// combined, as pigz does; restarting the dictionary every strip costs a
+// little ratio.  A strip's first row is filtered without the row above,
+// which belongs to another strip.  Compressed strips are written out in
+// file order, top first, as soon as all those before them have been.
+//
+// Without an image to read from, the caller passes the rows instead with
+// addRows(), which copies them into their strips; it waits while more
+// strips are waiting to be compressed than there are workers, so given
+// rows top first the writer only ever holds a few strips.
+class PngWriter
+{
+public:
+	PngWriter();
+	~PngWriter();
+
+	// Start writing the width x height image in rgb, which must stay
+	// valid until close(), or NULL to pass rows to addRows().  Returns
+	// false if the file can't be opened.
+	bool open(const char *iname, int width, int height, const unsigned char *rgb,
+		int rowsPerStrip = 64);
+
+	// Rows [y0, y1) of the image are final.  Every row must be reported
+	// once before close().
+	void rowsDone(int y0, int y1);
+
+	// Rows [y0, y1) of an image opened without one, from rows.
+	void addRows(const unsigned char *rows, int y0, int y1);
+
+	// Wait for the last strips and finish the file.  Returns false if
+	// anything failed to write.
+	bool close();
+
+private:
+	struct Strip
+	{
+		int rowsLeft;					// rows not yet reported done
+		bool compressed;
+		std::vector<unsigned char> rgb;	// its rows, top first, if copied
+		std::vector<unsigned char> data;	// raw deflate stream
+		unsigned long adler;			// checksum of the filtered rows
+		unsigned long filteredSize;
+	};
+
+	void work();
+	void stripDone(int s);
+	void compress(int s);
+	void writeReady();
+	void writeChunk(const char *type, const unsigned char *data, unsigned int size);
+
+	FILE *_file;
+	bool _ok;
+	int _width, _height, _rowsPerStrip;
+	const unsigned char *_rgb;
+	std::vector<Strip> _strips;
+	int _written;					// strips written to the file so far
+	unsigned long _adler;			// checksum of everything written
+
+	std::vector<std::thread> _workers;
+	std::deque<int> _queue;			// strips ready to compress
+	bool _closing;
+	std::mutex _lock;
+	std::condition_variable _ready;
+	std::condition_variable _taken;	// a worker took a strip off _queue
+};
+
+// Write the whole of an image in one go.
+extern bool writePNG(const char *iname, int width, int height, const unsigned char *data);
+
+#endif
@@ -0,0 +1,44 @@
+#include "frameBuffer.h"
+#include <algorithm>
+#include <cmath>
+
+void FrameBuffer::resolve(float* out, int begin, int end) const
+{
+    for(int p = begin; p < end; ++p)
+    {
+        float inv = _weight[p] > 0.0f ? 1.0f / _weight[p] : 0.0f;
+        for(int c = 0; c < 4; ++c)
+            out[(p - begin) * 4 + c] = _rgba[p * 4 + c] * inv;
+    }
+}
+
+// The operator is a template argument, so each loop is compiled without
+// a test of it; what's left per channel is a multiply and min/max.
+// Quantising truncates, as the tracer always has.
+template<FrameBuffer::ToneMap OP>
+static void toneMapPixels(unsigned char* out, const float* rgba, const float* weight,
+                          int begin, int end, float scale)
+{
+    for(int p = begin; p < end; ++p)
+    {
+        float inv = weight[p] > 0.0f ? scale / weight[p] : 0.0f;
+        for(int c = 0; c < 3; ++c)
+        {
+            float v = std::max(rgba[p * 4 + c] * inv, 0.0f);
+            if(OP == FrameBuffer::TONEMAP_REINHARD)
+                v = v / (1.0f + v);
+            out[p * 3 + c] = (unsigned char)(255.0f * std::min(v, 1.0f));
+        }
+    }
+}
+
+void FrameBuffer::toneMap(unsigned char* out, int begin, int end, float exposure, ToneMap op) const
+{
+    if(begin >= end)
+        return;
+    const float scale = std::pow(2.0f, exposure);
+    if(op == TONEMAP_REINHARD)
+        toneMapPixels<TONEMAP_REINHARD>(out, &_rgba[0], &_weight[0], begin, end, scale);
+    else
+        toneMapPixels<TONEMAP_CLAMP>(out, &_rgba[0], &_weight[0], begin, end, scale);
+}
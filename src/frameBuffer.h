@@ -0,0 +1,89 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include "vecmath/vec.h"
+#include <vector>
+
+/* The image a render accumulates, in linear floating point.
+
+   Every pixel holds the sums of the samples added to it (red, green, blue
+   and coverage, the fraction of them whose primary ray hit something)
+   and their total weight, so a pass can add samples to a pixel without
+   knowing what was there, and nothing is clamped until the image is tone
+   mapped for display.  The sums are interleaved RGBA, four floats a pixel,
+   so resolving and tone mapping stream through memory. */
+class FrameBuffer
+{
+public:
+    enum ToneMap
+    {
+        TONEMAP_CLAMP,      // clip to [0, 1]
+        TONEMAP_REINHARD    // x / (1 + x) per channel
+    };
+
+    FrameBuffer():_width(0),_height(0){}
+
+    void setup(int width, int height)
+    {
+        _width = width;
+        _height = height;
+        _rgba.assign(width * height * 4, 0.0f);
+        _weight.assign(width * height, 0.0f);
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    // Add samples of total weight n to pixel p: sum is their colours
+    // added up, and hits how many of them hit something.
+    void add(int p, const Vec3d& sum, double hits, double n)
+    {
+        float* rgba = &_rgba[p * 4];
+        rgba[0] += (float)sum[0];
+        rgba[1] += (float)sum[1];
+        rgba[2] += (float)sum[2];
+        rgba[3] += (float)hits;
+        _weight[p] += (float)n;
+    }
+
+    // Replace pixel p with the average col, of alpha coverage, over
+    // samples of total weight n.
+    void set(int p, const Vec3d& col, double alpha, double n)
+    {
+        float* rgba = &_rgba[p * 4];
+        rgba[0] = (float)(col[0] * n);
+        rgba[1] = (float)(col[1] * n);
+        rgba[2] = (float)(col[2] * n);
+        rgba[3] = (float)(alpha * n);
+        _weight[p] = (float)n;
+    }
+
+    float weight(int p) const { return _weight[p]; }
+
+    Vec3d color(int p) const
+    {
+        if(_weight[p] <= 0.0f)
+            return Vec3d(0.0, 0.0, 0.0);
+        const float* rgba = &_rgba[p * 4];
+        double inv = 1.0 / _weight[p];
+        return Vec3d(rgba[0] * inv, rgba[1] * inv, rgba[2] * inv);
+    }
+
+    double alpha(int p) const
+    {
+        return _weight[p] > 0.0f ? _rgba[p * 4 + 3] / _weight[p] : 0.0;
+    }
+
+    // The averages of pixels [begin, end), four floats each, into out.
+    void resolve(float* out, int begin, int end) const;
+
+    // Tone map pixels [begin, end) into 8-bit RGB in out, scaling by
+    // 2^exposure first.
+    void toneMap(unsigned char* out, int begin, int end, float exposure, ToneMap op) const;
+
+private:
+    int _width, _height;
+    std::vector<float> _rgba;       // sums, interleaved
+    std::vector<float> _weight;
+};
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,109 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+#include "vecmath/vec.h"
+#include <vector>
+#include <limits>
+
+class SceneObject;
+
+/* Per-pixel record of a render: the samples each pixel took and, when the
+   geometry planes are on, what its primary ray hit.
+
+   Every attribute is a flat array indexed by pixel (i + j * width), set up
+   once per render, so tracing allocates nothing and any thread can write
+   the pixels it traces without locking.  The geometry planes (depth along
+   the ray, normal, view angle, diffuse albedo and the primitive hit) are
+   only needed to find edges and guide the denoiser, and are left empty
+   otherwise.  A pixel traced with several samples keeps the last one's
+   hit. */
+class GBuffer
+{
+public:
+    GBuffer():_width(0),_height(0){}
+
+    void setup(int width, int height, bool geometry)
+    {
+        _width = width;
+        _height = height;
+        int size = width * height;
+        _samples.assign(size, 0);
+        if(!geometry)
+        {
+            std::vector<float>().swap(_depth);
+            std::vector<float>().swap(_normalX);
+            std::vector<float>().swap(_normalY);
+            std::vector<float>().swap(_normalZ);
+            std::vector<float>().swap(_viewAngle);
+            std::vector<float>().swap(_albedoR);
+            std::vector<float>().swap(_albedoG);
+            std::vector<float>().swap(_albedoB);
+            std::vector<const SceneObject*>().swap(_object);
+            return;
+        }
+        _depth.assign(size, std::numeric_limits<float>::infinity());
+        _normalX.assign(size, 0.0f);
+        _normalY.assign(size, 0.0f);
+        _normalZ.assign(size, 0.0f);
+        _viewAngle.assign(size, 0.0f);
+        _albedoR.assign(size, 0.0f);
+        _albedoG.assign(size, 0.0f);
+        _albedoB.assign(size, 0.0f);
+        _object.assign(size, (const SceneObject*)0);
+    }
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    bool hasGeometry() const { return !_depth.empty(); }
+
+    void setHit(int p, double t, const Vec3d& N, double viewAngle, const Vec3d& albedo,
+                const SceneObject* object)
+    {
+        _depth[p] = (float)t;
+        _normalX[p] = (float)N[0];
+        _normalY[p] = (float)N[1];
+        _normalZ[p] = (float)N[2];
+        _viewAngle[p] = (float)viewAngle;
+        _albedoR[p] = (float)albedo[0];
+        _albedoG[p] = (float)albedo[1];
+        _albedoB[p] = (float)albedo[2];
+        _object[p] = object;
+    }
+
+    // A ray that escaped: infinitely deep, and no primitive.
+    void setMiss(int p)
+    {
+        _depth[p] = std::numeric_limits<float>::infinity();
+        _normalX[p] = _normalY[p] = _normalZ[p] = 0.0f;
+        _viewAngle[p] = 0.0f;
+        _albedoR[p] = _albedoG[p] = _albedoB[p] = 0.0f;
+        _object[p] = 0;
+    }
+
+    void setSamples(int p, int n) { _samples[p] = (unsigned short)n; }
+
+    // Whether pixel p's primary ray hit anything: only misses are
+    // infinitely deep.
+    bool hit(int p) const { return _depth[p] < std::numeric_limits<float>::infinity(); }
+    float depth(int p) const { return _depth[p]; }
+    Vec3d normal(int p) const { return Vec3d(_normalX[p], _normalY[p], _normalZ[p]); }
+    float viewAngle(int p) const { return _viewAngle[p]; }
+    Vec3d albedo(int p) const { return Vec3d(_albedoR[p], _albedoG[p], _albedoB[p]); }
+    const SceneObject* object(int p) const { return _object[p]; }
+    int samples(int p) const { return _samples[p]; }
+    const std::vector<unsigned short>& sampleCounts() const { return _samples; }
+
+private:
+    int _width, _height;
+    std::vector<float> _depth;
+    std::vector<float> _normalX;
+    std::vector<float> _normalY;
+    std::vector<float> _normalZ;
+    std::vector<float> _viewAngle;
+    std::vector<float> _albedoR;
+    std::vector<float> _albedoG;
+    std::vector<float> _albedoB;
+    std::vector<const SceneObject*> _object;
+    std::vector<unsigned short> _samples;
+};
+
+#endif // GBUFFER_H
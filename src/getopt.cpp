@@ -91,14 +91,15 @@ int GetOption (
                             if (iArg+1 < argc)
                             {
                                 psz = &(argv[iArg+1][0]);
-                                if (*psz == '-' || *psz == '/')
+                                if (*psz == '-' && !isdigit(psz[1]) && psz[1] != '.')
                                 {
                                     // next argv is a new option, so param
                                     // not given for current option
                                 }
                                 else
                                 {
-                                    // next argv is the param
+                                    // next argv is the param, possibly a
+                                    // negative number or an absolute path
                                     iArg++;
                                     pszParam = psz;
                                 }
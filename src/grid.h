@@ -0,0 +1,276 @@
+#ifndef GRID_H
+#define GRID_H
+#include "scene/bbox.h"
+#include "scene/scene.h"
+#include "kdtree.h"
+#include "parallel.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+/* Uniform grid acceleration structure.
+
+   The grid is meant for scenes that are rebuilt every frame (particle
+   simulations and the like), where the k-d tree's SAH build costs more
+   than the render itself.  Building is a counting sort of object
+   references into cells: every object is visited a constant number of
+   times, so the build is O(N), and both passes over the objects are
+   split across worker threads.  Rays walk the cells they pierce with a
+   3D-DDA (Amanatides & Woo), front to back, and stop at the first cell
+   that contains a hit closer than the cell's exit point.
+
+   The resolution follows Cleary's rule: about _density cells per object,
+   with the cells as close to cubes as the scene bounds allow.  Traits is
+   the same intersector/bounds policy the k-d tree takes. */
+template<typename T, typename Traits = ObjectTraits<T> >
+class UniformGrid
+{
+public:
+    typedef T object_data_type;
+    typedef T* object_pointer;
+    typedef typename std::vector<T*>::const_iterator object_pointer_iterator;
+private:
+    BoundingBox _box;
+    int _res[3];
+    Vec3d _cellSize;
+    Vec3d _invCellSize;
+    double _density;
+    int _maxRes;
+    std::vector<unsigned int> _cellStart;       // numCells + 1 offsets into _refs
+    std::vector<object_pointer> _refs;          // object references, grouped by cell
+    std::vector<object_pointer> _unbounded;     // objects without a usable bounding box
+
+    int numCells() const
+    {
+        return _res[0] * _res[1] * _res[2];
+    }
+
+    int cellCoord(double p, int axis) const
+    {
+        int c = (int)((p - _box.getMin()[axis]) * _invCellSize[axis]);
+        return std::max(0, std::min(c, _res[axis] - 1));
+    }
+
+    // Range of cells overlapped by a bounding box, as [lo, hi] per axis.
+    void cellRange(const BoundingBox& box, int lo[3], int hi[3]) const
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            lo[axis] = cellCoord(box.getMin()[axis] - RAY_EPSILON, axis);
+            hi[axis] = cellCoord(box.getMax()[axis] + RAY_EPSILON, axis);
+        }
+    }
+
+    void chooseResolution(unsigned int numObjects)
+    {
+        Vec3d extent = _box.getMax() - _box.getMin();
+        double maxExtent = std::max(extent[0], std::max(extent[1], extent[2]));
+        // Flat scenes would otherwise give a zero volume; treat the thin
+        // axes as a thousandth of the largest one.
+        for(int axis = 0; axis < 3; ++axis)
+            extent[axis] = std::max(extent[axis], maxExtent * 1.0e-3 + RAY_EPSILON);
+        double volume = extent[0] * extent[1] * extent[2];
+        double cellsPerUnit = std::cbrt(_density * numObjects / volume);
+        for(int axis = 0; axis < 3; ++axis)
+            _res[axis] = std::max(1, std::min(_maxRes, (int)(extent[axis] * cellsPerUnit)));
+
+        Vec3d bmax = _box.getMin() + extent;
+        _box.setMax(maximum(_box.getMax(), bmax));
+        extent = _box.getMax() - _box.getMin();
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            _cellSize[axis] = extent[axis] / (double)_res[axis];
+            _invCellSize[axis] = 1.0 / _cellSize[axis];
+        }
+    }
+
+public:
+    UniformGrid(double density = 3.0, int maxRes = 256):_density(density),_maxRes(maxRes)
+    {
+        _res[0] = _res[1] = _res[2] = 0;
+    }
+
+    bool isBuilt() const
+    {
+        return numCells() > 0 || !_unbounded.empty();
+    }
+
+    int getResolution(int axis) const
+    {
+        return _res[axis];
+    }
+
+    unsigned int getNumReferences() const
+    {
+        return _refs.size();
+    }
+
+    bool buildGrid(object_pointer_iterator beginObjectsIt, object_pointer_iterator endObjectsIt)
+    {
+        if(isBuilt())
+            return false;
+
+        std::vector<object_pointer> objects;
+        objects.reserve(endObjectsIt - beginObjectsIt);
+        for(; beginObjectsIt != endObjectsIt; ++beginObjectsIt)
+        {
+            if(Traits::bounds(*beginObjectsIt).isEmpty())
+                _unbounded.push_back(*beginObjectsIt);
+            else
+            {
+                objects.push_back(*beginObjectsIt);
+                _box.merge(Traits::bounds(*beginObjectsIt));
+            }
+        }
+        if(objects.empty())
+            return true;
+
+        int numObjects = objects.size();
+        chooseResolution(numObjects);
+        int cells = numCells();
+
+        // Small scenes are not worth the thread start-up cost.
+        unsigned int workers = numObjects < 2048 ? 1 :
+            std::min(numWorkerThreads(), (unsigned int)(numObjects / 1024));
+
+        // Pass one: each worker counts the references its objects add to
+        // every cell.
+        std::vector<std::vector<unsigned int> > counts(workers, std::vector<unsigned int>(cells, 0));
+        parallelChunks(0, numObjects, [&](int b, int e, unsigned int w) {
+            std::vector<unsigned int>& count = counts[w];
+            int lo[3], hi[3];
+            for(int n = b; n < e; ++n)
+            {
+                cellRange(Traits::bounds(objects[n]), lo, hi);
+                for(int z = lo[2]; z <= hi[2]; ++z)
+                    for(int y = lo[1]; y <= hi[1]; ++y)
+                        for(int x = lo[0]; x <= hi[0]; ++x)
+                            ++count[x + _res[0] * (y + _res[1] * z)];
+            }
+        }, workers);
+
+        // Prefix sum: turn the counts into each worker's write offset in
+        // every cell, so the fill pass needs no synchronisation and gives
+        // the same order as a serial build.
+        _cellStart.resize(cells + 1);
+        unsigned int running = 0;
+        for(int c = 0; c < cells; ++c)
+        {
+            _cellStart[c] = running;
+            for(unsigned int w = 0; w < workers; ++w)
+            {
+                unsigned int n = counts[w][c];
+                counts[w][c] = running;
+                running += n;
+            }
+        }
+        _cellStart[cells] = running;
+
+        // Pass two: scatter the references.
+        _refs.resize(running);
+        parallelChunks(0, numObjects, [&](int b, int e, unsigned int w) {
+            std::vector<unsigned int>& offset = counts[w];
+            int lo[3], hi[3];
+            for(int n = b; n < e; ++n)
+            {
+                cellRange(Traits::bounds(objects[n]), lo, hi);
+                for(int z = lo[2]; z <= hi[2]; ++z)
+                    for(int y = lo[1]; y <= hi[1]; ++y)
+                        for(int x = lo[0]; x <= hi[0]; ++x)
+                            _refs[offset[x + _res[0] * (y + _res[1] * z)]++] = objects[n];
+            }
+        }, workers);
+        return true;
+    }
+
+    void deleteGrid()
+    {
+        _box = BoundingBox();
+        _res[0] = _res[1] = _res[2] = 0;
+        std::vector<unsigned int>().swap(_cellStart);
+        std::vector<object_pointer>().swap(_refs);
+        _unbounded.clear();
+    }
+
+    bool rayGridTraversal(isect& i, const ray& r) const
+    {
+        bool haveOne = false;
+        isect cur;
+        for(typename std::vector<object_pointer>::const_iterator it = _unbounded.begin(); it != _unbounded.end(); ++it)
+        {
+            if(Traits::intersect(*it, r, cur) && (!haveOne || cur.t < i.t))
+            {
+                i = cur;
+                haveOne = true;
+            }
+        }
+
+        double tMin = 0.0, tMax = 0.0;
+        if(_refs.empty() || !_box.intersect(r, tMin, tMax))
+            return haveOne;
+        tMin = std::max(tMin, 0.0);
+        if(haveOne && i.t < tMin)
+            return true;
+
+        const Vec3d& origin = r.getPosition();
+        const Vec3d& dir = r.getDirection();
+        Vec3d entry = r.at(tMin);
+        int cell[3], step[3], stop[3];
+        double tNext[3], tDelta[3];
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            cell[axis] = cellCoord(entry[axis], axis);
+            if(dir[axis] > 0.0)
+            {
+                step[axis] = 1;
+                stop[axis] = _res[axis];
+                tNext[axis] = (_box.getMin()[axis] + (cell[axis] + 1) * _cellSize[axis] - origin[axis]) / dir[axis];
+                tDelta[axis] = _cellSize[axis] / dir[axis];
+            }
+            else if(dir[axis] < 0.0)
+            {
+                step[axis] = -1;
+                stop[axis] = -1;
+                tNext[axis] = (_box.getMin()[axis] + cell[axis] * _cellSize[axis] - origin[axis]) / dir[axis];
+                tDelta[axis] = -_cellSize[axis] / dir[axis];
+            }
+            else
+            {
+                step[axis] = 0;
+                stop[axis] = -1;
+                tNext[axis] = 1.0e308;
+                tDelta[axis] = 1.0e308;
+            }
+        }
+
+        for(;;)
+        {
+            int c = cell[0] + _res[0] * (cell[1] + _res[1] * cell[2]);
+            int axis = (tNext[0] < tNext[1]) ? ((tNext[0] < tNext[2]) ? 0 : 2) : ((tNext[1] < tNext[2]) ? 1 : 2);
+            double tExit = tNext[axis];
+
+            for(unsigned int n = _cellStart[c]; n < _cellStart[c + 1]; ++n)
+            {
+                if(Traits::intersect(_refs[n], r, cur) && (!haveOne || cur.t < i.t))
+                {
+                    i = cur;
+                    haveOne = true;
+                }
+            }
+            // A hit inside this cell can't be beaten by anything further
+            // along the ray; a hit beyond it (an object that spans several
+            // cells) has to wait until we've walked that far.
+            if(haveOne && i.t <= tExit)
+                return true;
+            if(tExit > tMax)
+                break;
+            cell[axis] += step[axis];
+            if(cell[axis] == stop[axis])
+                break;
+            tNext[axis] += tDelta[axis];
+        }
+        return haveOne;
+    }
+};
+
+#endif // GRID_H
@@ -8,9 +8,6 @@
 #include <cassert>
 #include <set>
 #include <stack>
-#include "ui/TraceUI.h"
-
-extern TraceUI* traceUI;
 
 template<typename T>
 struct ComparePair{
@@ -20,15 +17,28 @@ bool operator()(T obj1, T obj2){
     else
         return false;}};
 
-/* Based from online source */
+/* Default intersector/bounds policy for KdTree and UniformGrid: go
+   through the object's own intersect() and getBoundingBox().  A policy
+   only needs the two static functions below; because the trees call them
+   through the policy type, the leaf loops are compiled per primitive type
+   and simple tests can be inlined.  See FaceTraits (trimesh.h) and
+   GeometryTraits (SceneObjects/GeometryTraits.h). */
 template<typename T>
+struct ObjectTraits{
+    static bool intersect(const T* obj, const ray& r, isect& i){
+        return obj->intersect(r, i);}
+    static const BoundingBox& bounds(const T* obj){
+        return obj->getBoundingBox();}};
+
+/* Based from online source */
+template<typename T, typename Traits = ObjectTraits<T> >
 class Node
 {
     public:
         typedef T object_data_type;
         typedef T* object_pointer;
         typedef typename std::vector<object_pointer>::const_iterator iterator;
-        typedef Node<T>* node_pointer;
+        typedef Node<T, Traits>* node_pointer;
         node_pointer _positiveHalf;
         node_pointer _negativeHalf;
     private:
@@ -84,7 +94,7 @@ class Node
 
         void addObject(object_pointer obj)
         {
-            BoundingBox box = obj->getBoundingBox();
+            BoundingBox box = Traits::bounds(obj);
             this->_box.merge(box);
             this->_surfaceArea+=box.area();
             _objects.push_back(obj);
@@ -92,7 +102,7 @@ class Node
 
         double getArea(object_pointer obj)
         {
-            BoundingBox tempBox = obj->getBoundingBox();
+            BoundingBox tempBox = Traits::bounds(obj);
             return tempBox.area();
         }
 
@@ -125,37 +135,63 @@ class Node
         {
             return _objects.size();
         }
+
+        // Recompute this subtree's boxes from its objects' current bounds,
+        // bottom-up.  Split planes and object lists are left alone.
+        void refit()
+        {
+            _box = BoundingBox();
+            if(isLeaf())
+            {
+                for(iterator it = _objects.begin(); it != _objects.end(); ++it)
+                    _box.merge(Traits::bounds(*it));
+                return;
+            }
+            if(_negativeHalf!=NULL)
+            {
+                _negativeHalf->refit();
+                _box.merge(_negativeHalf->getBoundingBox());
+            }
+            if(_positiveHalf!=NULL)
+            {
+                _positiveHalf->refit();
+                _box.merge(_positiveHalf->getBoundingBox());
+            }
+        }
 };
 
-template<typename T>
+template<typename T, typename Traits = ObjectTraits<T> >
 class KdTree
 {
 public:
     typedef T object_data_type;
     typedef T* object_pointer;
     typedef typename std::vector<T*>::const_iterator object_pointer_iterator;
-    typedef typename Node<object_data_type>::node_pointer node_pointer;
+    typedef Node<object_data_type, Traits> node_type;
+    typedef typename node_type::node_pointer node_pointer;
 private:
     double _ti, _tt;
     int _depth;
     int _minObjs;
     node_pointer _root;
+    bool _refitted;         // boxes refit since the build; split planes are stale
+    double _buildCost;      // SAH cost right after the last build
 
-    double computeHMedian(Node<object_data_type>* node, int dim, double& bestD){
-        typedef std::pair<double, typename Node<object_data_type>::iterator > internalType;
+    double computeHMedian(node_type* node, int dim, double& bestD){
+        typedef std::pair<double, typename node_type::iterator > internalType;
         if(!node->hasObjects())
         {
             return -1.0f;
         }
         double h;
-        std::vector<std::pair<double, typename Node<object_data_type>::iterator> > objDistancePairs;
+        std::vector<std::pair<double, typename node_type::iterator> > objDistancePairs;
         objDistancePairs.reserve(2*node->getNumObjects());
-        for(typename Node<object_data_type>::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it)
+        for(typename node_type::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it)
         {
-            assert(!((*it)->getBoundingBox().isEmpty()));
+            assert(!(Traits::bounds(*it).isEmpty()));
             double d1;
             double d2;
-            (*it)->getBoundingBox().getPlaneNormsDists(dim, d1, d2);
+            Traits::bounds(*it).getPlaneNormsDists(dim, d1, d2);
             objDistancePairs.push_back(std::make_pair(d1,it));
             objDistancePairs.push_back(std::make_pair(d2,it));
         }
@@ -167,11 +203,11 @@ private:
         int negHalf = 0;
         int posHalf = 0;
 
-        for(typename Node<object_data_type>::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it){
-            assert(!((*it)->getBoundingBox().isEmpty()));
+        for(typename node_type::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it){
+            assert(!(Traits::bounds(*it).isEmpty()));
             double d1;
             double d2;
-            (*it)->getBoundingBox().getPlaneNormsDists(dim, d1, d2);
+            Traits::bounds(*it).getPlaneNormsDists(dim, d1, d2);
             if(bestD>=d2){
                 ++negHalf;
             } else if(bestD<=d1){
@@ -183,31 +219,31 @@ private:
         return h;
         }
 
-    double computeH(Node<object_data_type>* node, int dim, double& bestD){
-        typedef std::pair<double, typename Node<object_data_type>::iterator > internalType;
+    double computeH(node_type* node, int dim, double& bestD){
+        typedef std::pair<double, typename node_type::iterator > internalType;
         if(!node->hasObjects()){
             return -1.0f;}
         double totalArea = node->getBoxArea();
         double min = 1.0e308; // 1.0e308 is close to infinity... close enough for us!
-        std::vector<std::pair<double, typename Node<object_data_type>::iterator> > objDistancePairs;
+        std::vector<std::pair<double, typename node_type::iterator> > objDistancePairs;
         objDistancePairs.reserve(2*node->getNumObjects());
 
-        for(typename Node<object_data_type>::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it){
+        for(typename node_type::iterator it = node->getBeginIterator(); it!=node->getEndIterator(); ++it){
             double d1;
             double d2;
-            (*it)->getBoundingBox().getPlaneNormsDists(dim, d1, d2);
+            Traits::bounds(*it).getPlaneNormsDists(dim, d1, d2);
             objDistancePairs.push_back(std::make_pair(d1,it));
             objDistancePairs.push_back(std::make_pair(d2,it));}
         std::sort(objDistancePairs.begin(), objDistancePairs.end(), ComparePair<internalType>());
 
-        std::set<typename Node<object_data_type>::iterator> transientSet;
+        std::set<typename node_type::iterator> transientSet;
         int negCounter = 0, posCounter = node->getNumObjects();
         double negativeArea = 0.0f;
         double positiveArea = node->getObjectsArea();
         double hValue, negP, posP;
         typename std::vector<internalType>::iterator prevIt = objDistancePairs.end();
         for(typename std::vector<internalType>::iterator it=objDistancePairs.begin(); it!= objDistancePairs.end(); ++it){
-            typename std::set<typename Node<object_data_type>::iterator>::iterator deleteLoc = transientSet.find((*it).second);
+            typename std::set<typename node_type::iterator>::iterator deleteLoc = transientSet.find((*it).second);
             if(!(deleteLoc == transientSet.end())){
                 double tempArea = node->getArea(*((*deleteLoc)));
                 if((*prevIt).second == (*deleteLoc)){
@@ -235,18 +271,21 @@ private:
             prevIt = it;}
         return min;}
 
+    // SAH picks between the surface area heuristic and median splits; it's
+    // a template parameter so the choice is made once per build.
+    template<bool SAH>
     node_pointer splitNode(node_pointer node, int depth, int minObjs){
         unsigned int currNumObjs = node->getNumObjects();
         if(currNumObjs<=minObjs || depth < 0){
             return node;}
-        node_pointer positiveNode = new Node<object_data_type>();
-        node_pointer negativeNode = new Node<object_data_type>();
+        node_pointer positiveNode = new node_type();
+        node_pointer negativeNode = new node_type();
 
         double xD = 0.0f;
         double yD = 0.0f;
         double zD = 0.0f;
         double xH = 0.0f, yH = 0.0f, zH = 0.0f;
-        if(traceUI->useSurface()){
+        if(SAH){
              xH = computeH(node,0,xD);
              yH = computeH(node,1,yD);
              zH = computeH(node,2,zD);
@@ -273,12 +312,12 @@ private:
             hMin = zH;
             dMin = zD;}
 
-        typename Node<object_data_type>::iterator it = node->getBeginIterator();
+        typename node_type::iterator it = node->getBeginIterator();
 
         while(it!=node->getEndIterator()){
             double d1;
             double d2;
-            (*it)->getBoundingBox().getPlaneNormsDists(dim, d1, d2);
+            Traits::bounds(*it).getPlaneNormsDists(dim, d1, d2);
             if(dMin>=d2){
                 negativeNode->addObject(*it);
             } else if(dMin<=d1){
@@ -288,8 +327,8 @@ private:
                 positiveNode->addObject(*it);}
             ++it;}
         //*improve* add objects inline
-        node->_positiveHalf = splitNode(positiveNode, depth - 1, minObjs);
-        node->_negativeHalf = splitNode(negativeNode, depth - 1, minObjs);
+        node->_positiveHalf = splitNode<SAH>(positiveNode, depth - 1, minObjs);
+        node->_negativeHalf = splitNode<SAH>(negativeNode, depth - 1, minObjs);
         return node;}
 
     struct stackElement{
@@ -297,16 +336,73 @@ private:
         double tMin;
         double tMax;
         stackElement(node_pointer n=NULL, double tmin=1.0e308, double tmax=-1.0e308):node(n),tMin(tmin),tMax(tmax){}};
+
+    // Surface area heuristic cost of a subtree; rootArea turns box areas
+    // into hit probabilities.
+    double sahCost(node_pointer node, double rootArea){
+        double p = node->getBoxArea()/rootArea;
+        if(node->isLeaf())
+            return p*node->getNumObjects()*_ti;
+        double cost = p*_tt;
+        if(node->_negativeHalf!=NULL)
+            cost += sahCost(node->_negativeHalf, rootArea);
+        if(node->_positiveHalf!=NULL)
+            cost += sahCost(node->_positiveHalf, rootArea);
+        return cost;}
+
+    double treeCost(){
+        double rootArea = _root->getBoxArea();
+        if(rootArea <= 0.0)
+            return 0.0;
+        return sahCost(_root, rootArea);}
+
+    static bool hitBox(node_pointer node, const ray& r, double& tMin, double& tMax){
+        return node!=NULL && node->hasObjects() && node->getBoundingBox().intersect(r, tMin, tMax);}
+
+    // Traversal for a refit tree.  Objects may have moved across the old
+    // split planes, so the tree is walked as a bounding volume hierarchy
+    // instead: visit every child whose box the ray hits, nearest first, and
+    // skip boxes that start beyond the closest hit found so far.
+    bool rayBoxTraversal(isect& i, const ray& r){
+        double tMin = 0.0, tMax = 0.0;
+        if(!hitBox(_root, r, tMin, tMax))
+            return false;
+        std::stack<stackElement> stack;
+        stack.push(stackElement(_root, tMin, tMax));
+        bool haveOne = false;
+        isect cur;
+        while(!stack.empty()){
+            stackElement current = stack.top();
+            stack.pop();
+            if(haveOne && current.tMin > i.t)
+                continue;
+            node_pointer node = current.node;
+            if(node->isLeaf()){
+                for(typename node_type::iterator it = node->getBeginIterator(); it != node->getEndIterator(); ++it){
+                    if(Traits::intersect(*it, r, cur) && (!haveOne || cur.t < i.t)){
+                        i = cur;
+                        haveOne = true;}}
+                continue;}
+            stackElement nearElem(node->_negativeHalf), farElem(node->_positiveHalf);
+            bool hitNear = hitBox(nearElem.node, r, nearElem.tMin, nearElem.tMax);
+            bool hitFar = hitBox(farElem.node, r, farElem.tMin, farElem.tMax);
+            if(hitNear && hitFar && farElem.tMin < nearElem.tMin)
+                std::swap(nearElem, farElem);
+            if(hitFar)
+                stack.push(farElem);
+            if(hitNear)
+                stack.push(nearElem);}
+        return haveOne;}
 public:
-    KdTree(double ti = 1, double tt = 80, int depth = 15, int minObjs = 3):_root(NULL),_ti(ti), _tt(tt),_depth(depth),_minObjs(minObjs){}
+    KdTree(double ti = 1, double tt = 80, int depth = 15, int minObjs = 3):_root(NULL),_ti(ti), _tt(tt),_depth(depth),_minObjs(minObjs),_refitted(false),_buildCost(0.0){}
 
     ~KdTree(){
         deleteTree();}
 
-    bool buildTree(object_pointer_iterator beginObjectsIt, object_pointer_iterator endObjectsIt){
+    bool buildTree(object_pointer_iterator beginObjectsIt, object_pointer_iterator endObjectsIt, bool useSurface = false){
         if(_root!=NULL)
             return false;
-        _root = new Node<object_data_type>();
+        _root = new node_type();
 
         while(beginObjectsIt!=endObjectsIt){
             assert((*beginObjectsIt)->hasBoundingBoxCapability());
@@ -314,9 +410,30 @@ public:
             ++beginObjectsIt;}
 
 
-        splitNode(_root, _depth, _minObjs);
+        if(useSurface)
+            splitNode<true>(_root, _depth, _minObjs);
+        else
+            splitNode<false>(_root, _depth, _minObjs);
+        _refitted = false;
+        _buildCost = treeCost();
         return true;}
 
+    // Refit the tree to its objects' current bounds in O(N), without
+    // re-splitting (for animated transforms).  Returns how far the tree
+    // has degraded: its SAH cost now divided by its cost when it was
+    // built.  Callers rebuild once this gets too large.
+    double refitTree(){
+        if(_root == NULL)
+            return 1.0;
+        _root->refit();
+        _refitted = true;
+        if(_buildCost <= 0.0)
+            return 1.0;
+        return treeCost()/_buildCost;}
+
+    bool isBuilt() const{
+        return _root != NULL;}
+
     void deleteTree(){
         if(_root == NULL)
             return;
@@ -325,6 +442,10 @@ public:
 
 
     bool rayTreeTraversal(isect& i, const ray& r){
+            if(_root == NULL)
+                return false;
+            if(_refitted)
+                return rayBoxTraversal(i, r);
             double tMin=0.0f, tMax=0.0f, tPlane=0.0f;
             if(!_root->getBoundingBox().intersect( r, tMin, tMax))
                 return false;
@@ -384,16 +505,16 @@ public:
                 object_pointer closestObject = NULL;
                 isect minIntersection;
                 bool haveOne = false;
-                typename Node<object_data_type>::iterator it = parent->getBeginIterator();
+                typename node_type::iterator it = parent->getBeginIterator();
                 isect cur;
                 Vec3d pointOfintersect(0.0f,0.0f,0.0f);
                 while (it != parent->getEndIterator()){
                     //calculate intersection
                     //check if it exists in boundbox
                     //check vs closest point
-                    if( (*it)->intersect(r, cur )){
+                    if( Traits::intersect(*it, r, cur)){
                         pointOfintersect = r.at(cur.t );
-                        if((*it)->getBoundingBox().intersects(pointOfintersect)){
+                        if(Traits::bounds(*it).intersects(pointOfintersect)){
                             if(!haveOne){
                                 minIntersection = cur;
                                 closestObject = *it;
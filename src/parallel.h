@@ -0,0 +1,50 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+// Small helpers for running loops across worker threads.
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Number of worker threads used by the parallel helpers below.
+inline unsigned int numWorkerThreads()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Split [begin, end) into one contiguous chunk per worker and call
+// fn(chunkBegin, chunkEnd, worker) for each chunk on its own thread.
+// Chunks are assigned in order, so worker w always gets a range that
+// comes before worker w+1's.  Returns the number of workers used.
+template<typename F>
+unsigned int parallelChunks(int begin, int end, F fn, unsigned int maxWorkers = 0)
+{
+    int count = end - begin;
+    if(count <= 0)
+        return 0;
+    unsigned int workers = maxWorkers ? maxWorkers : numWorkerThreads();
+    workers = std::min(workers, (unsigned int)count);
+    if(workers <= 1)
+    {
+        fn(begin, end, 0u);
+        return 1;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(workers - 1);
+    int chunk = (count + workers - 1) / workers;
+    for(unsigned int w = 1; w < workers; ++w)
+    {
+        int b = std::min(begin + (int)w * chunk, end);
+        int e = std::min(b + chunk, end);
+        threads.push_back(std::thread(fn, b, e, w));
+    }
+    fn(begin, std::min(begin + chunk, end), 0u);
+    for(std::vector<std::thread>::iterator t = threads.begin(); t != threads.end(); ++t)
+        t->join();
+    return workers;
+}
+
+#endif // __PARALLEL_H__
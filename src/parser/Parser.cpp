@@ -62,12 +62,18 @@ Scene* Parser::parseScene()
       case DIRECTIONAL_LIGHT:
          scene->add( parseDirectionalLight( scene ) );
          break;
+      case AREA_LIGHT:
+         scene->add( parseAreaLight( scene ) );
+         break;
       case AMBIENT_LIGHT:
          parseAmbientLight( scene );
          break;
       case CAMERA:
          parseCamera( scene );
          break;
+      case ACCELERATOR:
+         parseAccelerator( scene );
+         break;
       case MATERIAL:
 		 {
            auto_ptr<Material> temp( parseMaterialExpression( scene, *mat ));
@@ -678,7 +684,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
         if(traceUI->acceleration()){
-            tmesh->constructKDTree();
+            tmesh->constructKDTree(traceUI->useSurface());
         }
         scene->add( tmesh );
         return;
@@ -726,6 +732,22 @@ void Parser::parseAmbientLight( Scene* scene )
   return;
 }
 
+// accelerator = kdtree | grid | auto;
+// Lets a scene pick the acceleration structure it should be rendered
+// with, overriding the UI setting.
+void Parser::parseAccelerator( Scene* scene )
+{
+  string name = parseIdentExpression();
+  if( name == "kdtree" )
+    scene->setAcceleratorHint( ACCEL_KDTREE );
+  else if( name == "grid" )
+    scene->setAcceleratorHint( ACCEL_GRID );
+  else if( name == "auto" )
+    scene->setAcceleratorHint( ACCEL_AUTO );
+  else
+    throw SyntaxErrorException( "Expected: 'kdtree', 'grid' or 'auto'", _tokenizer );
+}
+
 PointLight* Parser::parsePointLight( Scene* scene )
 {
   Vec3d position;
@@ -833,6 +855,100 @@ DirectionalLight* Parser::parseDirectionalLight( Scene* scene )
   }
 }
 
+// An area light is a rectangle (edge_u and edge_v, the full edges,
+// centred on position) or a sphere (radius).  samples is the number of
+// shadow rays used in its penumbra.
+AreaLight* Parser::parseAreaLight( Scene* scene )
+{
+  Vec3d position;
+  Vec3d color;
+  Vec3d edgeU, edgeV;
+  double radius = 0.0;
+  int samples = 16;
+
+  float constantAttenuationCoefficient = 0.0f;
+  float linearAttenuationCoefficient = 0.0f;
+  float quadraticAttenuationCoefficient = 1.0f;
+
+  bool hasPosition( false ), hasColor( false ), hasEdgeU( false ), hasEdgeV( false ), hasRadius( false );
+
+  _tokenizer.Read( AREA_LIGHT );
+  _tokenizer.Read( LBRACE );
+
+  for( ;; )
+  {
+     const Token* t = _tokenizer.Peek();
+     switch( t->kind() )
+     {
+       case POSITION:
+         if( hasPosition )
+           throw SyntaxErrorException( "Repeated 'position' attribute", _tokenizer );
+         position = parseVec3dExpression();
+         hasPosition = true;
+         break;
+
+       case COLOR:
+         if( hasColor )
+            throw SyntaxErrorException( "Repeated 'color' attribute", _tokenizer );
+         color = parseVec3dExpression();
+         hasColor = true;
+         break;
+
+       case EDGE_U:
+         edgeU = parseVec3dExpression();
+         hasEdgeU = true;
+         break;
+
+       case EDGE_V:
+         edgeV = parseVec3dExpression();
+         hasEdgeV = true;
+         break;
+
+       case LIGHT_RADIUS:
+         radius = parseScalarExpression();
+         hasRadius = true;
+         break;
+
+       case LIGHT_SAMPLES:
+         samples = (int)parseScalarExpression();
+         break;
+
+       case CONSTANT_ATTENUATION_COEFF:
+         constantAttenuationCoefficient = parseScalarExpression();
+		 break;
+
+       case LINEAR_ATTENUATION_COEFF:
+         linearAttenuationCoefficient = parseScalarExpression();
+		 break;
+         
+       case QUADRATIC_ATTENUATION_COEFF:
+         quadraticAttenuationCoefficient = parseScalarExpression();
+		 break;
+
+       case RBRACE:
+         if( !hasColor )
+           throw SyntaxErrorException( "Expected: 'color'", _tokenizer );
+         if( !hasPosition )
+           throw SyntaxErrorException( "Expected: 'position'", _tokenizer );
+         if( hasRadius == (hasEdgeU || hasEdgeV) )
+           throw SyntaxErrorException( "Expected: 'edge_u' and 'edge_v', or 'light_radius'", _tokenizer );
+         if( hasEdgeU != hasEdgeV )
+           throw SyntaxErrorException( "Expected: both 'edge_u' and 'edge_v'", _tokenizer );
+         _tokenizer.Read( RBRACE );
+         if( hasRadius )
+           return new SphereLight( scene, position, color, constantAttenuationCoefficient,
+             linearAttenuationCoefficient, quadraticAttenuationCoefficient, samples, radius );
+         return new RectangleLight( scene, position, color, constantAttenuationCoefficient,
+           linearAttenuationCoefficient, quadraticAttenuationCoefficient, samples, edgeU, edgeV );
+
+        default:
+          throw SyntaxErrorException( 
+			  "expecting 'position', 'color', 'edge_u', 'edge_v', 'light_radius' or 'light_samples' attribute, or 'constant_attenuation_coeff', 'linear_attenuation_coeff', or 'quadratic_attenuation_coeff'", 
+            _tokenizer );
+     }
+  }
+}
+
 // These ought to be done with template member functions, but compiler support for
 // these is rather iffy...
 double Parser::parseScalarExpression()
@@ -62,8 +62,12 @@ private:
     // Parse lights
 	PointLight* parsePointLight( Scene* scene );
 	DirectionalLight* parseDirectionalLight( Scene* scene );
+	AreaLight* parseAreaLight( Scene* scene );
 	void parseAmbientLight( Scene* scene );
 
+    // Parse scene-wide render hints
+    void parseAccelerator( Scene* scene );
+
     // Parse geometry
     void      parseSphere(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseBox(Scene* scene, TransformNode* transform, const Material& mat);
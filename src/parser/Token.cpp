@@ -89,6 +89,12 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ MAP ]               = "map";
     tokenNames[ BUMP_MAPPING ]      = "bump_mapping";
     tokenNames[ BUMP ]              = "bump";
+    tokenNames[ ACCELERATOR ]       = "accelerator";
+    tokenNames[ AREA_LIGHT ]        = "area_light";
+    tokenNames[ EDGE_U ]            = "edge_u";
+    tokenNames[ EDGE_V ]            = "edge_v";
+    tokenNames[ LIGHT_RADIUS ]      = "light_radius";
+    tokenNames[ LIGHT_SAMPLES ]     = "light_samples";
   }
   // search tokenNames table
   std::map<int, string>::const_iterator itr = 
@@ -169,6 +175,12 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["viewdir"] = VIEWDIR;
     reservedWords["bump_mapping"] = BUMP_MAPPING;
     reservedWords["bump"] = BUMP;
+    reservedWords["accelerator"] = ACCELERATOR;
+    reservedWords["area_light"] = AREA_LIGHT;
+    reservedWords["edge_u"] = EDGE_U;
+    reservedWords["edge_v"] = EDGE_V;
+    reservedWords["light_radius"] = LIGHT_RADIUS;
+    reservedWords["light_samples"] = LIGHT_SAMPLES;
 
   }
 
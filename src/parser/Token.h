@@ -84,7 +84,14 @@ enum SYMBOL {
   MAP,
 
   BUMP_MAPPING,
-  BUMP
+  BUMP,
+
+  ACCELERATOR,              // acceleration structure selection
+
+  AREA_LIGHT,               // area lights and their shape
+  EDGE_U, EDGE_V,
+  LIGHT_RADIUS,
+  LIGHT_SAMPLES
 };
 
 // Helper functions
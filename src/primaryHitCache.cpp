@@ -0,0 +1,41 @@
+#include "primaryHitCache.h"
+#include "scene/camera.h"
+#include "scene/scene.h"
+
+bool PrimaryHitCache::Entry::restore(isect& i) const
+{
+    i.obj = obj;
+    i.t = t;
+    i.N = N;
+    i.uvCoordinates = uv;
+    i.bary = bary;
+    if(ownMaterial)
+        i.setMaterial(obj->getMaterial());
+    return found;
+}
+
+void PrimaryHitCache::setup(int width, int height, int samples, const Camera& camera, int mode)
+{
+    if(samples > MAX_SAMPLES)
+        samples = MAX_SAMPLES;
+    if(width == _width && height == _height && samples == _samples && mode == _mode &&
+       camera.getEye() == _eye && camera.getLook() == _look &&
+       camera.getU() == _u && camera.getV() == _v)
+        return;
+    _width = width;
+    _height = height;
+    _samples = samples;
+    _mode = mode;
+    _eye = camera.getEye();
+    _look = camera.getLook();
+    _u = camera.getU();
+    _v = camera.getV();
+    _entries.assign(width * height * samples, Entry());
+}
+
+void PrimaryHitCache::clear()
+{
+    std::vector<Entry>().swap(_entries);
+    _width = _height = _samples = 0;
+    _mode = -1;
+}
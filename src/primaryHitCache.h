@@ -0,0 +1,95 @@
+#ifndef PRIMARYHITCACHE_H
+#define PRIMARYHITCACHE_H
+#include "vecmath/vec.h"
+#include "scene/ray.h"
+#include <vector>
+
+class Camera;
+
+/* What the primary rays of the last renders hit, kept so that a render
+   of the same view only has to shade: after a light or material edit
+   every primary ray would otherwise walk the acceleration structure again
+   to find the hit it found last time.
+
+   Entries are indexed by pixel and sample index, for the first
+   MAX_SAMPLES samples of each pixel, and remember the film position the
+   ray went through; a sample only replays an entry made for exactly the
+   same position, so the tracer's different sampling patterns can share
+   the cache without mixing up their rays.  Misses are kept too.  The
+   hit's material isn't: a replayed hit reads it from the primitive, so
+   material edits show up.  Primitives that hand back their own copy of
+   the material (trimesh faces) get a fresh copy of the primitive's, and
+   hits that don't name their primitive are never kept.
+
+   setup() keeps the entries only while the camera, image size and trace
+   mode stay the same, and clear() throws them away when the geometry
+   changes.  Each pixel is traced by one thread at a time, so lookups and
+   stores take no lock. */
+class PrimaryHitCache
+{
+public:
+    enum { MAX_SAMPLES = 4 };
+
+    struct Entry
+    {
+        Entry():valid(false),found(false),ownMaterial(false),obj(0),t(0.0){}
+
+        // Whether this is the hit of the ray through film position (x, y).
+        bool matches(double x, double y) const { return valid && filmX == x && filmY == y; }
+        // Put the hit back into i, a fresh isect, and return whether there
+        // was one.
+        bool restore(isect& i) const;
+        void store(double x, double y, bool hit, const isect& i)
+        {
+            if(hit && !i.obj)
+            {
+                valid = false;
+                return;
+            }
+            filmX = x;
+            filmY = y;
+            found = hit;
+            ownMaterial = hit && i.material;
+            obj = i.obj;
+            t = i.t;
+            N = i.N;
+            uv = i.uvCoordinates;
+            bary = i.bary;
+            valid = true;
+        }
+
+        bool valid, found;
+        bool ownMaterial;       // the hit came with a copy of obj's material
+        double filmX, filmY;    // where the ray went through the film
+        const SceneObject* obj;
+        double t;
+        Vec3d N;
+        Vec2d uv;
+        Vec3d bary;
+    };
+
+    PrimaryHitCache():_width(0),_height(0),_samples(0),_mode(-1){}
+
+    // Get ready for a width x height render through camera with up to
+    // samples samples a pixel, traced in mode.  Entries survive if all of
+    // that is as it was last time.
+    void setup(int width, int height, int samples, const Camera& camera, int mode);
+
+    // Forget every entry and free them.
+    void clear();
+
+    // The entry for sample index of pixel p, or NULL if it isn't kept.
+    Entry* entry(int p, int index)
+    {
+        if(index >= _samples || p < 0 || p >= _width * _height)
+            return NULL;
+        return &_entries[p * _samples + index];
+    }
+
+private:
+    int _width, _height, _samples, _mode;
+    Vec3d _eye, _look, _u, _v;
+    std::vector<Entry> _entries;
+};
+
+#endif // PRIMARYHITCACHE_H
@@ -0,0 +1,138 @@
+#include "progressiveRenderer.h"
+#include "RayTracer.h"
+#include "parallel.h"
+#include <algorithm>
+
+ProgressiveRenderer::ProgressiveRenderer()
+    : _tracer(NULL), _width(0), _height(0), _cancel(false), _running(false),
+      _pass(0), _passes(0), _tilesDone(0), _updates(0), _updatesSeen(0)
+{
+}
+
+ProgressiveRenderer::~ProgressiveRenderer()
+{
+    cancel();
+}
+
+void ProgressiveRenderer::start(RayTracer* tracer, int width, int height)
+{
+    cancel();
+    _tracer = tracer;
+    _width = width;
+    _height = height;
+    tracer->traceSetup(width, height);
+
+    // Tiles nearest the centre first, where the eye goes.
+    const int tile = RayTracer::TILE_SIZE;
+    std::vector<std::pair<long long, int> > order;
+    for(int y = 0; y < height; y += tile)
+    {
+        for(int x = 0; x < width; x += tile)
+        {
+            long long dx = 2 * x + tile - width, dy = 2 * y + tile - height;
+            order.push_back(std::make_pair(dx * dx + dy * dy, (int)order.size()));
+        }
+    }
+    std::stable_sort(order.begin(), order.end());
+    int tilesX = (width + tile - 1) / tile;
+    _tiles.clear();
+    for(size_t t = 0; t < order.size(); ++t)
+    {
+        _tiles.push_back(order[t].second % tilesX * tile);
+        _tiles.push_back(order[t].second / tilesX * tile);
+    }
+
+    // 1, 2, 4, ... samples a pixel, ending on exactly the sample size
+    // squared.
+    int target = tracer->renderSettings().sampleSize * tracer->renderSettings().sampleSize;
+    _sampleCounts.clear();
+    for(int n = 1; n < target; n *= 2)
+        _sampleCounts.push_back(n);
+    _sampleCounts.push_back(std::max(target, 1));
+
+    _pass = 0;
+    _passes = 1 + (int)_sampleCounts.size();
+    _tilesDone = 0;
+    _cancel = false;
+    _running = true;
+    _controller = std::thread(&ProgressiveRenderer::render, this);
+}
+
+void ProgressiveRenderer::cancel()
+{
+    _cancel = true;
+    if(_controller.joinable())
+        _controller.join();
+    _running = false;
+}
+
+bool ProgressiveRenderer::changed()
+{
+    unsigned int updates = _updates;
+    bool result = updates != _updatesSeen;
+    _updatesSeen = updates;
+    return result;
+}
+
+double ProgressiveRenderer::progress() const
+{
+    return _tiles.empty() ? 1.0 : _tilesDone / (double)(_tiles.size() / 2);
+}
+
+void ProgressiveRenderer::render()
+{
+    const int block = PREVIEW_BLOCK;
+    RayTracer* tracer = _tracer;
+    bool finished = runPass([=](int x0, int y0, int x1, int y1) {
+        tracer->tracePreviewTile(x0, y0, x1, y1, block);
+        return true;
+    });
+
+    int samples = 0;
+    for(size_t p = 0; finished && p < _sampleCounts.size(); ++p)
+    {
+        _pass = 1 + (int)p;
+        int first = samples, last = _sampleCounts[p];
+        const std::atomic<bool>& cancelled = _cancel;
+        finished = runPass([=, &cancelled](int x0, int y0, int x1, int y1) {
+            for(int s = first; s < last; ++s)
+            {
+                if(cancelled)
+                    return false;
+                tracer->refineTile(x0, y0, x1, y1, s);
+            }
+            return true;
+        });
+        samples = last;
+    }
+
+    if(finished)
+    {
+        tracer->denoise();
+        ++_updates;
+    }
+    _running = false;
+}
+
+// Trace every tile with traceTile(x0, y0, x1, y1), which returns false if
+// it stopped for cancel(), across the worker threads.  Returns false if
+// cancelled.
+template<typename F>
+bool ProgressiveRenderer::runPass(F traceTile)
+{
+    const int tile = RayTracer::TILE_SIZE;
+    const int tiles = _tiles.size() / 2;
+    std::atomic<int> next(0);
+    _tilesDone = 0;
+    parallelChunks(0, numWorkerThreads(), [&](int, int, unsigned int) {
+        for(int t = next++; t < tiles && !_cancel; t = next++)
+        {
+            int x0 = _tiles[2 * t], y0 = _tiles[2 * t + 1];
+            if(!traceTile(x0, y0, std::min(x0 + tile, _width), std::min(y0 + tile, _height)))
+                return;
+            ++_tilesDone;
+            ++_updates;
+        }
+    });
+    return !_cancel;
+}
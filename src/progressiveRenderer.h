@@ -0,0 +1,69 @@
+#ifndef PROGRESSIVERENDERER_H
+#define PROGRESSIVERENDERER_H
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class RayTracer;
+
+/* Renders on background threads, refining the image in passes, so a
+   front end stays responsive and shows something useful at once.
+
+   The first pass is a coarse preview, one sample per PREVIEW_BLOCK
+   square; the second traces every pixel once through its centre; each
+   after that adds as many samples per pixel as the pixels already have,
+   up to the render's sample size squared, and the image is denoised at
+   the end if the settings ask for it.  Within a pass, tiles are handed
+   to worker threads nearest the centre of the image first.
+
+   The frame buffer acts as the back buffer: samples accumulate there,
+   and a tile is only tone mapped into the tracer's 8-bit image, which is
+   what gets displayed, once its pass over it is complete.  So the display
+   never shows a tile half refined, and a front end can draw it whenever
+   it likes.  Everything a front end calls runs on its own thread and
+   doesn't wait on tracing except cancel(), which returns as soon as each
+   worker finishes the single sample per pixel of the tile it is on. */
+class ProgressiveRenderer
+{
+public:
+    enum { PREVIEW_BLOCK = 8 };
+
+    ProgressiveRenderer();
+    ~ProgressiveRenderer();
+
+    // Cancel any render in progress and start a width x height one.  Must
+    // be called from the thread the UI's settings belong to, as it calls
+    // tracer->traceSetup().
+    void start(RayTracer* tracer, int width, int height);
+    void cancel();
+
+    bool running() const { return _running; }
+    // True if the image has changed since the last call.
+    bool changed();
+    // The pass under way (0 is the preview) out of passes(), and the
+    // fraction of its tiles done.
+    int pass() const { return _pass; }
+    int passes() const { return _passes; }
+    double progress() const;
+
+private:
+    void render();
+    template<typename F>
+    bool runPass(F traceTile);
+
+    RayTracer* _tracer;
+    int _width, _height;
+    std::vector<int> _tiles;            // top-left pixels, x then y, in the order traced
+    std::vector<int> _sampleCounts;     // samples per pixel after each refinement pass
+
+    std::thread _controller;
+    std::atomic<bool> _cancel;
+    std::atomic<bool> _running;
+    std::atomic<int> _pass;
+    std::atomic<int> _passes;
+    std::atomic<int> _tilesDone;
+    std::atomic<unsigned int> _updates; // tiles finished, ever
+    unsigned int _updatesSeen;
+};
+
+#endif // PROGRESSIVERENDERER_H
@@ -1,9 +1,142 @@
+#include <atomic>
+
 #include "light.h"
+#include "sampler.h"
 
 
 
 using namespace std;
 
+namespace {
+	std::atomic<unsigned int> cacheEpoch( 1 );
+	std::atomic<unsigned long long> cacheTests( 0 );
+	std::atomic<unsigned long long> cacheHits( 0 );
+
+	struct ThreadOccluders
+	{
+		unsigned int epoch;
+		vector<const Geometry*> entries;
+	};
+
+	// This thread's entries, emptied if a reset happened since they were
+	// last used.
+	vector<const Geometry*>& threadOccluders()
+	{
+		thread_local ThreadOccluders occluders = { 0, vector<const Geometry*>() };
+		unsigned int epoch = cacheEpoch.load( std::memory_order_relaxed );
+		if( occluders.epoch != epoch )
+		{
+			occluders.entries.clear();
+			occluders.epoch = epoch;
+		}
+		return occluders.entries;
+	}
+
+	bool isOpaque( const isect& i )
+	{
+		Vec3d kTransmit = i.getMaterial().kt(i);
+		return kTransmit[0] <= 0 && kTransmit[1] <= 0 && kTransmit[2] <= 0;
+	}
+}
+
+const Geometry* OccluderCache::get( int light )
+{
+	vector<const Geometry*>& entries = threadOccluders();
+	return light >= 0 && light < (int)entries.size() ? entries[light] : NULL;
+}
+
+void OccluderCache::set( int light, const Geometry* obj )
+{
+	if( light < 0 )
+		return;
+	vector<const Geometry*>& entries = threadOccluders();
+	if( light >= (int)entries.size() )
+		entries.resize( light + 1, NULL );
+	entries[light] = obj;
+}
+
+void OccluderCache::reset()
+{
+	cacheEpoch.fetch_add( 1, std::memory_order_relaxed );
+	cacheTests.store( 0, std::memory_order_relaxed );
+	cacheHits.store( 0, std::memory_order_relaxed );
+}
+
+void OccluderCache::count( bool hit )
+{
+	cacheTests.fetch_add( 1, std::memory_order_relaxed );
+	if( hit )
+		cacheHits.fetch_add( 1, std::memory_order_relaxed );
+}
+
+unsigned long long OccluderCache::tests() { return cacheTests.load( std::memory_order_relaxed ); }
+unsigned long long OccluderCache::hits() { return cacheHits.load( std::memory_order_relaxed ); }
+
+// A cached occluder only counts if it's opaque where this ray hits it; a
+// transmissive blocker needs the full query to get its colour right.
+bool Light::cachedOccluder( const ray& r, double maxT ) const
+{
+    if( !scene->renderSettings().occluderCache )
+        return false;
+    const Geometry* last = OccluderCache::get( index );
+    if( last == NULL )
+        return false;
+    isect i;
+    bool hit = last->intersect( r, i ) && i.t < maxT && isOpaque( i );
+    OccluderCache::count( hit );
+    return hit;
+}
+
+bool Light::mappedShadow( const Vec3d& P, const SceneObject* surface, Vec3d& attenuation ) const
+{
+    if( !shadowMap.isBuilt() )
+        return false;
+    switch( shadowMap.lookup( P, surface ) )
+    {
+    case ShadowMap::LIT:
+        attenuation = Vec3d(1,1,1);
+        return true;
+    case ShadowMap::SHADOWED:
+        attenuation = Vec3d(0,0,0);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Light that gets through glass still stops at anything opaque behind it,
+// so the query looks past transmissive hits before maxT for an opaque
+// one, and returns that instead if there is one.  The answer is then the
+// same whether or not cachedOccluder() found the blocker first.
+bool Light::intersectShadow( const ray& r, double maxT, isect& i ) const
+{
+    static const int MAX_TRANSMISSIVE = 16;     // surfaces to look through
+
+    const Geometry* hitObject;
+    if( !scene->intersect( r, i, hitObject ) )
+        return false;
+    ray along( r );
+    double start = 0.0;     // how far along r the ray along starts
+    isect hit( i );
+    for( int n = 0; n < MAX_TRANSMISSIVE && start + hit.t < maxT && !isOpaque( hit ); ++n )
+    {
+        start += hit.t;
+        along = ray( along.at( hit.t ), along.getDirection(), ray::SHADOW );
+        const Geometry* behindObject;
+        if( !scene->intersect( along, hit, behindObject ) )
+            break;
+        if( start + hit.t < maxT && isOpaque( hit ) )
+        {
+            i = hit;
+            i.t += start;
+            hitObject = behindObject;
+        }
+    }
+    if( scene->renderSettings().occluderCache && i.t < maxT && isOpaque( i ) )
+        OccluderCache::set( index, hitObject );
+    return true;
+}
+
 double DirectionalLight::distanceAttenuation( const Vec3d& P ) const
 {
 	return 1.0;
@@ -11,11 +144,16 @@ double DirectionalLight::distanceAttenuation( const Vec3d& P ) const
 
 
 
-Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P ) const
+Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P, const SceneObject* surface ) const
 {
+    Vec3d mapped;
+    if(mappedShadow(P, surface, mapped))
+        return mapped;
     ray rayToLight(P,getDirection(P),ray::SHADOW);
+    if(cachedOccluder(rayToLight, 1.0e308))
+        return Vec3d(0,0,0);
     isect i;
-    if(scene->intersect( rayToLight, i ))
+    if(intersectShadow( rayToLight, 1.0e308, i ))
     {
         Vec3d color(0.0f,0.0f,0.0f);
         Vec3d kTransmit = i.getMaterial().kt(i);
@@ -36,6 +174,12 @@ Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P ) const
     return Vec3d(1,1,1); //else return white
 }
 
+void DirectionalLight::buildShadowMap( int res )
+{
+    if( shadowMap.resolution() != res )
+        shadowMap.buildOrtho( scene, orientation, res );
+}
+
 Vec3d DirectionalLight::getColor( const Vec3d& P ) const
 {
 	return color;
@@ -52,6 +196,30 @@ double PointLight::distanceAttenuation( const Vec3d& P ) const
 	return std::min(1.0,(double)1.0/(double)(constantTerm + linearTerm*v.length() + quadraticTerm*v.length()*v.length()));
 }
 
+// Solve max(color) * f(d) = cutoff for d, with f(d) = min(1, 1/(a + bd + cd^2))
+// as in distanceAttenuation().  Without a linear or quadratic term the
+// light never falls off, so it has no bound.
+bool PointLight::influenceSphere( double cutoff, Vec3d& center, double& radius ) const
+{
+	center = position;
+	double brightest = max( color[0], max( color[1], color[2] ) );
+	if( cutoff <= 0.0 || quadraticTerm < 0.0f || (quadraticTerm == 0.0f && linearTerm <= 0.0f) )
+		return false;
+	radius = 0.0;
+	if( brightest <= cutoff )
+		return true;
+	double k = constantTerm - brightest / cutoff;
+	if( quadraticTerm > 0.0f )
+	{
+		double disc = (double)linearTerm * linearTerm - 4.0 * quadraticTerm * k;
+		if( disc > 0.0 )
+			radius = max( 0.0, (-linearTerm + sqrt( disc )) / (2.0 * quadraticTerm) );
+	}
+	else
+		radius = max( 0.0, -k / linearTerm );
+	return true;
+}
+
 Vec3d PointLight::getColor( const Vec3d& P ) const
 {
 	return color;
@@ -65,14 +233,29 @@ Vec3d PointLight::getDirection( const Vec3d& P ) const
 }
 
 
-Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
+Vec3d PointLight::shadowAttenuation(const Vec3d& P, const SceneObject* surface) const
 {
-    Vec3d v = position - P;
+    Vec3d mapped;
+    if(mappedShadow(P, surface, mapped))
+        return mapped;
+    return attenuationTowards(P, position);}
+
+void PointLight::buildShadowMap( int res )
+{
+    if( shadowMap.resolution() != res )
+        shadowMap.buildCube( scene, position, res );
+}
+
+Vec3d PointLight::attenuationTowards(const Vec3d& P, const Vec3d& target) const
+{
+    Vec3d v = target - P;
     double t = v.length();
     v.normalize();
     ray rayToLight(P ,v ,ray::SHADOW);
+    if(cachedOccluder(rayToLight, t))
+        return Vec3d(0,0,0);
     isect i;
-    if(scene->intersect(rayToLight, i))
+    if(intersectShadow(rayToLight, t, i))
     {
         if(t>i.t)
         {
@@ -82,7 +265,9 @@ Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
             double distBetween = 1.0f;
             isect internal;
             Vec3d pointOnObject = rayToLight.at(currentPoint);
-            if(scene->intersect(ray(pointOnObject,getDirection(pointOnObject),ray::SHADOW),internal))
+            Vec3d towardsLight = target - pointOnObject;
+            towardsLight.normalize();
+            if(scene->intersect(ray(pointOnObject,towardsLight,ray::SHADOW),internal))
                 distBetween = internal.t;
             double light_attenuation = std::min(1.0,(double)1.0/(double)(constantTerm + linearTerm*distBetween + quadraticTerm*distBetween*distBetween));
             if(kTransmit[0]>0||kTransmit[1]>0||kTransmit[2]>0){
@@ -92,3 +277,72 @@ Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
         }
     }
     return Vec3d(1,1,1);}
+
+// Fraction of the light visible from P, per channel.  The probes are a
+// jittered 2x2 pattern; if they all agree the point is taken to be fully
+// lit or fully shadowed.  Otherwise the full budget is spent on a jittered
+// n x n grid, and the probes are averaged in with it.
+Vec3d AreaLight::shadowAttenuation(const Vec3d& P, const SceneObject* /*surface*/) const
+{
+    Sampler& sampler = Sampler::current();
+    Vec3d total(0.0f,0.0f,0.0f);
+    int lit = 0;
+    for(int p = 0; p < PROBES; ++p)
+    {
+        double s = ((p % 2) + sampler.next()) / 2.0;
+        double t = ((p / 2) + sampler.next()) / 2.0;
+        Vec3d a = attenuationTowards(P, samplePoint(P, s, t));
+        if(a[0] >= 1.0 && a[1] >= 1.0 && a[2] >= 1.0)
+            ++lit;
+        total += a;
+    }
+    if(lit == PROBES)
+        return Vec3d(1,1,1);
+    if(lit == 0 && total[0] <= 0.0 && total[1] <= 0.0 && total[2] <= 0.0)
+        return Vec3d(0,0,0);
+
+    int n = (int)std::sqrt((double)samples);
+    for(int y = 0; y < n; ++y)
+        for(int x = 0; x < n; ++x)
+        {
+            double s = (x + sampler.next()) / n;
+            double t = (y + sampler.next()) / n;
+            total += attenuationTowards(P, samplePoint(P, s, t));
+        }
+    return total / (double)(PROBES + n * n);
+}
+
+// Anywhere on the light can be the closest point, so grow the point
+// light's sphere by the light's extent.
+bool AreaLight::influenceSphere( double cutoff, Vec3d& center, double& radius ) const
+{
+    if(!PointLight::influenceSphere(cutoff, center, radius))
+        return false;
+    if(radius > 0.0)
+        radius += extent();
+    return true;
+}
+
+Vec3d RectangleLight::samplePoint( const Vec3d& /*P*/, double s, double t ) const
+{
+    return position + (s - 0.5) * edgeU + (t - 0.5) * edgeV;
+}
+
+double RectangleLight::extent() const
+{
+    return 0.5 * std::max((edgeU + edgeV).length(), (edgeU - edgeV).length());
+}
+
+// Uniform over the disc through the centre, facing P.
+Vec3d SphereLight::samplePoint( const Vec3d& P, double s, double t ) const
+{
+    Vec3d w = P - position;
+    w.normalize();
+    Vec3d a = (std::fabs(w[0]) > 0.9) ? Vec3d(0,1,0) : Vec3d(1,0,0);
+    Vec3d u = a ^ w;
+    u.normalize();
+    Vec3d v = w ^ u;
+    double r = radius * std::sqrt(s);
+    double phi = 2.0 * M_PI * t;
+    return position + (r * std::cos(phi)) * u + (r * std::sin(phi)) * v;
+}
@@ -8,37 +8,94 @@ using std::max;
 #endif
 
 #include "scene.h"
+#include "shadowMap.h"
 
 class Light
 	: public SceneElement
 {
 public:
-	virtual Vec3d shadowAttenuation(const Vec3d& P) const = 0;
+	// How much of the light reaches P, on the primitive surface (NULL if
+	// P isn't on one), per channel.
+	virtual Vec3d shadowAttenuation(const Vec3d& P, const SceneObject* surface) const = 0;
 	virtual double distanceAttenuation( const Vec3d& P ) const = 0;
 	virtual Vec3d getColor( const Vec3d& P ) const = 0;
 	virtual Vec3d getDirection( const Vec3d& P ) const = 0;
 
+	// The sphere outside of which this light's brightest channel, after
+	// distance attenuation, is below cutoff; a radius of 0 means it never
+	// gets there.  Returns false for lights that reach everywhere.  Used
+	// to build the scene's LightTree.
+	virtual bool influenceSphere( double /*cutoff*/, Vec3d& /*center*/, double& /*radius*/ ) const
+		{ return false; }
+
+	// Position in the scene's light list, set by Scene::add().
+	int getIndex() const { return index; }
+	void setIndex( int i ) { index = i; }
+
+	// Build (or rebuild at a new resolution) the ShadowMap that settles
+	// most shadow queries without a ray.  Only lights with hard shadows
+	// have one; for the rest this does nothing.  Maps must be cleared
+	// whenever the geometry moves.
+	virtual void buildShadowMap( int /*res*/ ) {}
+	void clearShadowMap() { shadowMap.clear(); }
+
 protected:
 	Light( Scene *scene, const Vec3d& col )
-		: SceneElement( scene ), color( col ) {}
+		: SceneElement( scene ), color( col ), index( -1 ) {}
+
+	// Shadow ray tests that go through the OccluderCache when the render
+	// settings ask for it.  cachedOccluder() says whether the object that
+	// last blocked this light on this thread blocks r before maxT too;
+	// intersectShadow() is scene->intersect(), except that it returns the
+	// first opaque object before maxT even behind transmissive ones, and
+	// remembers it.
+	bool cachedOccluder( const ray& r, double maxT ) const;
+	bool intersectShadow( const ray& r, double maxT, isect& i ) const;
+
+	// If the shadow map settles whether P, on surface, is lit, set
+	// attenuation to 1 or 0 and return true.
+	bool mappedShadow( const Vec3d& P, const SceneObject* surface, Vec3d& attenuation ) const;
 
 	Vec3d 		color;
+	int			index;
+	ShadowMap	shadowMap;
 
 public:
 	virtual void glDraw(GLenum lightID) const { }
 	virtual void glDraw() const { }
 };
 
+// Per thread, the last opaque object each light's shadow rays hit.  Shadow
+// rays from neighbouring points usually end on the same blocker, so trying
+// it on its own first saves a full scene query for most shadowed points.
+// Entries are indexed by Light::getIndex().  Nothing is shared between
+// threads except the epoch and the hit counters.
+class OccluderCache
+{
+public:
+	static const Geometry* get( int light );
+	static void set( int light, const Geometry* obj );
+
+	// Drop every thread's entries (they may point into an old scene) and
+	// zero the counters.  Call before a render starts.
+	static void reset();
+
+	static void count( bool hit );
+	static unsigned long long tests();
+	static unsigned long long hits();
+};
+
 class DirectionalLight
 	: public Light
 {
 public:
 	DirectionalLight( Scene *scene, const Vec3d& orien, const Vec3d& color )
 		: Light( scene, color ), orientation( orien ) { orientation.normalize(); }
-	virtual Vec3d shadowAttenuation(const Vec3d& P) const;
+	virtual Vec3d shadowAttenuation(const Vec3d& P, const SceneObject* surface) const;
 	virtual double distanceAttenuation( const Vec3d& P ) const;
 	virtual Vec3d getColor( const Vec3d& P ) const;
 	virtual Vec3d getDirection( const Vec3d& P ) const;
+	virtual void buildShadowMap( int res );
 
 protected:
 	Vec3d 		orientation;
@@ -61,10 +118,12 @@ public:
 		quadraticTerm(quadraticAttenuationTerm) 
 		{}
 
-	virtual Vec3d shadowAttenuation(const Vec3d& P) const;
+	virtual Vec3d shadowAttenuation(const Vec3d& P, const SceneObject* surface) const;
 	virtual double distanceAttenuation( const Vec3d& P ) const;
 	virtual Vec3d getColor( const Vec3d& P ) const;
 	virtual Vec3d getDirection( const Vec3d& P ) const;
+	virtual bool influenceSphere( double cutoff, Vec3d& center, double& radius ) const;
+	virtual void buildShadowMap( int res );
 
 	void setAttenuationConstants( float a, float b, float c )
 	{
@@ -74,6 +133,9 @@ public:
 	}
 
 protected:
+	// Shadow attenuation along the segment from P to a point on the light.
+	Vec3d attenuationTowards( const Vec3d& P, const Vec3d& target ) const;
+
 	Vec3d position;
 
 	// These three values are the a, b, and c in the distance
@@ -92,4 +154,83 @@ protected:
 
 };
 
+// A light with a surface.  It lights a point like a point light at its
+// centre would, but its shadows are soft: shadowAttenuation() averages
+// the shadow rays to a stratified set of points on the surface.  To keep
+// that affordable, a few probe rays go first, and only points the probes
+// disagree about (the penumbra) get the full budget of samples.
+class AreaLight
+	: public PointLight
+{
+public:
+	AreaLight( Scene *scene, const Vec3d& pos, const Vec3d& color,
+		float constantAttenuationTerm, float linearAttenuationTerm,
+		float quadraticAttenuationTerm, int numSamples )
+		: PointLight( scene, pos, color, constantAttenuationTerm,
+			linearAttenuationTerm, quadraticAttenuationTerm ),
+		samples( numSamples < PROBES ? PROBES : numSamples )
+		{}
+
+	virtual Vec3d shadowAttenuation(const Vec3d& P, const SceneObject* surface) const;
+	virtual bool influenceSphere( double cutoff, Vec3d& center, double& radius ) const;
+	// A map from the centre says nothing about the penumbra.
+	virtual void buildShadowMap( int /*res*/ ) {}
+
+	int getSamples() const { return samples; }
+
+protected:
+	// The point on the light for (s, t) in [0,1)^2, as seen from P.
+	virtual Vec3d samplePoint( const Vec3d& P, double s, double t ) const = 0;
+	// Distance from the centre to the furthest point of the light.
+	virtual double extent() const = 0;
+
+	// Probe rays, as a 2x2 stratified pattern.
+	static const int PROBES = 4;
+
+	int samples;		// shadow rays for a penumbra point
+};
+
+// A parallelogram centred on position, spanned by edgeU and edgeV.
+class RectangleLight
+	: public AreaLight
+{
+public:
+	RectangleLight( Scene *scene, const Vec3d& pos, const Vec3d& color,
+		float constantAttenuationTerm, float linearAttenuationTerm,
+		float quadraticAttenuationTerm, int numSamples,
+		const Vec3d& u, const Vec3d& v )
+		: AreaLight( scene, pos, color, constantAttenuationTerm,
+			linearAttenuationTerm, quadraticAttenuationTerm, numSamples ),
+		edgeU( u ), edgeV( v )
+		{}
+
+protected:
+	virtual Vec3d samplePoint( const Vec3d& P, double s, double t ) const;
+	virtual double extent() const;
+
+	Vec3d edgeU;
+	Vec3d edgeV;
+};
+
+// A sphere around position.  From any point it's sampled as the disc
+// it presents to that point.
+class SphereLight
+	: public AreaLight
+{
+public:
+	SphereLight( Scene *scene, const Vec3d& pos, const Vec3d& color,
+		float constantAttenuationTerm, float linearAttenuationTerm,
+		float quadraticAttenuationTerm, int numSamples, double r )
+		: AreaLight( scene, pos, color, constantAttenuationTerm,
+			linearAttenuationTerm, quadraticAttenuationTerm, numSamples ),
+		radius( r )
+		{}
+
+protected:
+	virtual Vec3d samplePoint( const Vec3d& P, double s, double t ) const;
+	virtual double extent() const { return radius; }
+
+	double radius;
+};
+
 #endif // __LIGHT_H__
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cmath>
+
+#include "lightTree.h"
+#include "light.h"
+
+using namespace std;
+
+// Lights per leaf.  Leaves are tested sphere by sphere, which is cheaper
+// than another level of boxes for a handful of lights.
+static const int LEAF_SIZE = 4;
+
+void LightTree::clear()
+{
+	nodes.clear();
+	lights.clear();
+	unbounded.clear();
+	cutoff = 0.0;
+}
+
+void LightTree::build( vector<Light*>::const_iterator begin,
+	vector<Light*>::const_iterator end, double c )
+{
+	clear();
+	cutoff = c;
+	for( ; begin != end; ++begin )
+	{
+		Bounded b;
+		double radius;
+		if( !(*begin)->influenceSphere( cutoff, b.center, radius ) )
+			unbounded.push_back( *begin );
+		else if( radius > 0.0 )
+		{
+			// Lights that can't reach the cutoff anywhere are dropped.
+			b.light = *begin;
+			b.radius2 = radius * radius;
+			lights.push_back( b );
+		}
+	}
+	if( !lights.empty() )
+		buildNode( 0, lights.size() );
+}
+
+// Median split on the longest axis of the sphere centres.
+int LightTree::buildNode( int first, int count )
+{
+	int index = nodes.size();
+	nodes.push_back( Node() );
+
+	BoundingBox box;
+	BoundingBox centers;
+	for( int n = first; n < first + count; ++n )
+	{
+		double r = sqrt( lights[n].radius2 );
+		Vec3d extent( r, r, r );
+		box.merge( BoundingBox( lights[n].center - extent, lights[n].center + extent ) );
+		centers.merge( BoundingBox( lights[n].center, lights[n].center ) );
+	}
+	nodes[index].box = box;
+	nodes[index].first = first;
+	nodes[index].count = count;
+	nodes[index].right = -1;
+	if( count <= LEAF_SIZE )
+		return index;
+
+	Vec3d size = centers.getMax() - centers.getMin();
+	int axis = 0;
+	if( size[1] > size[axis] ) axis = 1;
+	if( size[2] > size[axis] ) axis = 2;
+	int half = count / 2;
+	nth_element( lights.begin() + first, lights.begin() + first + half,
+		lights.begin() + first + count,
+		[axis]( const Bounded& a, const Bounded& b ) { return a.center[axis] < b.center[axis]; } );
+
+	nodes[index].count = 0;
+	buildNode( first, half );
+	int right = buildNode( first + half, count - half );
+	nodes[index].right = right;
+	return index;
+}
+
+void LightTree::collect( const Vec3d& P, vector<Light*>& out ) const
+{
+	out.insert( out.end(), unbounded.begin(), unbounded.end() );
+	if( nodes.empty() )
+		return;
+
+	int stack[64];
+	int top = 0;
+	stack[top++] = 0;
+	while( top > 0 )
+	{
+		int index = stack[--top];
+		const Node& node = nodes[index];
+		if( !node.box.intersects( P ) )
+			continue;
+		if( node.right < 0 )
+		{
+			for( int n = node.first; n < node.first + node.count; ++n )
+			{
+				Vec3d d = P - lights[n].center;
+				if( d * d < lights[n].radius2 )
+					out.push_back( lights[n].light );
+			}
+		}
+		else
+		{
+			stack[top++] = node.right;
+			stack[top++] = index + 1;
+		}
+	}
+}
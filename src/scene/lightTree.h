@@ -0,0 +1,70 @@
+//
+// lightTree.h
+//
+// A bounding volume hierarchy over the lights of a scene, so that shading
+// only visits the lights that can light a point measurably.
+//
+
+#ifndef __LIGHT_TREE_H__
+#define __LIGHT_TREE_H__
+
+#include <vector>
+
+#include "../vecmath/vec.h"
+#include "ray.h"
+#include "bbox.h"
+
+class Light;
+
+// Every light with a finite reach (see Light::influenceSphere) goes into
+// the tree as the sphere outside of which it contributes less than the
+// cutoff.  A point is then lit by the lights whose spheres contain it,
+// plus the lights that reach everywhere (directional lights), which are
+// kept on the side.
+class LightTree
+{
+public:
+	LightTree() : cutoff( 0.0 ) {}
+
+	// Build over [begin, end) for the given cutoff intensity.  Clears any
+	// previous tree.
+	void build( std::vector<Light*>::const_iterator begin,
+		std::vector<Light*>::const_iterator end, double cutoff );
+	void clear();
+	bool isBuilt() const { return !nodes.empty() || !unbounded.empty(); }
+	double getCutoff() const { return cutoff; }
+
+	// Append to out every light that may light point P.
+	void collect( const Vec3d& P, std::vector<Light*>& out ) const;
+
+	int numBounded() const { return lights.size(); }
+	int numUnbounded() const { return unbounded.size(); }
+
+private:
+	struct Bounded
+	{
+		Light* light;
+		Vec3d center;
+		double radius2;
+	};
+
+	// Nodes are stored depth first; an inner node's left child follows it
+	// and its right child is at index right.  Leaves cover lights
+	// [first, first + count).
+	struct Node
+	{
+		BoundingBox box;
+		int right;
+		int first;
+		int count;
+	};
+
+	int buildNode( int first, int count );
+
+	std::vector<Node> nodes;
+	std::vector<Bounded> lights;
+	std::vector<Light*> unbounded;
+	double cutoff;
+};
+
+#endif // __LIGHT_TREE_H__
@@ -1,68 +1,226 @@
 #include "ray.h"
 #include "material.h"
 #include "light.h"
+#include "shadowQueue.h"
+#include "shadingCache.h"
+#include "sampler.h"
 
 #include "../fileio/bitmap.h"
 #include "../fileio/pngimage.h"
-#include "../ui/TraceUI.h"
 
 using namespace std;
 extern bool debugMode;
-extern TraceUI* traceUI;
+
+// Call shadeLight(light, weight) for the lights that reach intsec: all of
+// them, the ones the scene's LightTree finds, or a weighted sample of
+// those.
+template<typename ShadeLight>
+static void shadeLights( Scene *scene, const RenderSettings& settings, const Vec3d& intsec, ShadeLight& shadeLight )
+{
+    const LightTree& tree = scene->lightTree();
+    if(!tree.isBuilt())
+    {
+        for ( vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); ++litr )
+            shadeLight(*litr, 1.0);
+        return;
+    }
+
+    // Only the lights whose influence reaches this point.
+    static thread_local vector<Light*> candidates;
+    candidates.clear();
+    tree.collect(intsec, candidates);
+    int budget = settings.lightBudget;
+    if(budget <= 0 || (int)candidates.size() <= budget)
+    {
+        for ( vector<Light*>::const_iterator litr = candidates.begin(); litr != candidates.end(); ++litr )
+            shadeLight(*litr, 1.0);
+        return;
+    }
+
+    // Too many: draw budget lights, with replacement, in proportion to
+    // their unshadowed brightness here, and weight each by 1/(budget p) so
+    // the sum stays unbiased.  Lights drawn twice are shaded once.
+    static thread_local vector<double> cdf;
+    static thread_local vector<int> draws;
+    int count = candidates.size();
+    cdf.resize(count);
+    draws.assign(count, 0);
+    double total = 0.0;
+    for(int n = 0; n < count; ++n)
+    {
+        Vec3d c = candidates[n]->getColor(intsec);
+        total += max(c[0], max(c[1], c[2])) * candidates[n]->distanceAttenuation(intsec);
+        cdf[n] = total;
+    }
+    if(total <= 0.0)
+        return;
+    for(int s = 0; s < budget; ++s)
+    {
+        double u = total * Sampler::current().next();
+        ++draws[upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()];
+    }
+    for(int n = 0; n < count; ++n)
+    {
+        if(draws[n] == 0)
+            continue;
+        double p = (cdf[n] - (n > 0 ? cdf[n - 1] : 0.0)) / total;
+        shadeLight(candidates[n], draws[n] / (budget * p));
+    }
+}
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-Vec3d Material::shade( Scene *scene, const ray& r, const isect& i ) const
+template<bool NPR, bool BUMP>
+Vec3d Material::shade( Scene *scene, const ray& r, const isect& i, const RenderSettings& settings ) const
 {
     Vec3d intensity(0.0f,0.0f,0.0f);
-    Vec3d e_intensity = ke(i);
-    Vec3d a_intensity = ka(i);
-    a_intensity %=  scene->ambient();
-	const Vec3d intsec = r.at(i.t);
+    Vec3d e_intensity(0.0f,0.0f,0.0f);
+    Vec3d a_intensity(0.0f,0.0f,0.0f);
+    if(_nonzero & TERM_EMISSIVE)
+        e_intensity = ke(i);
+    if(_nonzero & TERM_AMBIENT)
+    {
+        a_intensity = ka(i);
+        a_intensity %=  scene->ambient();
+    }
+
+    // Phong shading of a material with no diffuse or specular term gets
+    // nothing from the lights, so don't even fire their shadow rays.
+    const bool has_diffuse = (_nonzero & TERM_DIFFUSE) != 0;
+    const bool has_specular = (_nonzero & TERM_SPECULAR) != 0;
+    if(!NPR && !has_diffuse && !has_specular)
+        return (intensity + e_intensity + a_intensity);
+
+    const Vec3d intsec = r.at(i.t);
     double a_x = 0.2f;
     double b_x = 0.6f;
     const Vec3d blue_temp(0.0f,0.0f,0.4f);
     const Vec3d yellow_temp(0.4f,0.4f,0.0f);
-    bool is_not_real = traceUI->nonRealism();
-	for ( vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); ++litr ){
-            Light* point = *litr;
+
+    // Nothing below depends on the light, so look it up once per hit.
+    const Vec3d k_d = has_diffuse ? kd(i) : Vec3d(0.0f,0.0f,0.0f);
+    const Vec3d k_s = has_specular ? ks(i) : Vec3d(0.0f,0.0f,0.0f);
+    const double shine = !has_specular ? 0.0 :
+        (_textured & TERM_SHININESS) ? shininess(i) : _constShininess;
+    bool is_bumped = false;
+    Vec3d perturbed;
+    if(BUMP && !NPR && (_nonzero & TERM_BUMP))
+    {
+        Vec3d bumped = bump(i, settings.bumpScale);
+        if(bumped[0] != 2.0f){
+            is_bumped = true;
+            perturbed = 2.0f*bumped-1.0f;
+            perturbed.normalize();
+        }
+    }
+
+    // Diffuse lighting doesn't depend on where it's seen from, so primary
+    // hits close together on the same primitive can share it.  What they
+    // share is the light reaching the surface, before k_d, so that each
+    // sample still reads its own texel.  A bumped normal and NPR shading
+    // of a textured k_d vary within the cell too, so they aren't shared.
+    ShadowQueue* queue = ShadowQueue::active();
+    const bool cacheable = settings.shadingCache && queue == NULL &&
+        !has_specular && r.type() == ray::VISIBILITY &&
+        !(BUMP && !NPR && (_nonzero & TERM_BUMP)) &&
+        !(NPR && (_textured & TERM_DIFFUSE));
+    const Vec3d light_kd = (cacheable && !NPR) ? Vec3d(1.0f,1.0f,1.0f) : k_d;
+
+    // Add one light's contribution, scaled by weight (which is only ever
+    // not 1 when lights are sampled).  With a ShadowQueue active the
+    // contribution is queued instead, to be shadowed and added later.
+    auto shadeLight = [&](const Light* point, double weight) {
             Vec3d light_direction = point->getDirection(intsec);
 			Vec3d surface_normal = i.N;
 			double light_normal = surface_normal * light_direction;
-            Vec3d dirA = (light_direction*surface_normal)*surface_normal;
-			Vec3d dirB = dirA - light_direction;
-            Vec3d dirC = dirA + dirB;
-			dirC.normalize();
-            double ray_normal = (-1 * r.getDirection()) * dirC;
             Vec3d shadow(1.0f,1.0f,1.0f);
 
-            if(is_not_real)
+            if(NPR)
             {
                 double cool = (1.0f+ (-1.0f)* light_normal)/2.0f;
                 double warm = 1.0f - cool;
-                Vec3d diffuse = (cool * ( blue_temp + kd(i) * a_x)) + (warm * ( yellow_temp + kd(i) * b_x));
-                //Vec3d specular = ks(i) * point->getColor(intsec);
-                shadow %= diffuse; //+ specular * std::pow(std::max(ray_normal,0.0),shininess(i)));
+                Vec3d diffuse = (cool * ( blue_temp + k_d * a_x)) + (warm * ( yellow_temp + k_d * b_x));
+                shadow %= diffuse;
             } 
             else 
             {
-                if(bump(i, traceUI->getBumpScale())[0]!= 2.0f){
-                    Vec3d perturbed = 2.0f*bump(i, traceUI->getBumpScale())-1.0f;
-                    perturbed.normalize();
+                if(is_bumped)
                     light_normal = perturbed * light_direction;
+                Vec3d color = point->getColor(intsec);
+                Vec3d lit(0.0f,0.0f,0.0f);
+                if(has_diffuse)
+                {
+                    Vec3d diffuse = light_kd;
+                    diffuse%=color;
+                    lit = diffuse * std::max(light_normal, 0.0);
+                }
+                if(has_specular)
+                {
+                    Vec3d dirA = (light_direction*surface_normal)*surface_normal;
+                    Vec3d dirB = dirA - light_direction;
+                    Vec3d dirC = dirA + dirB;
+                    dirC.normalize();
+                    double ray_normal = (-1 * r.getDirection()) * dirC;
+                    Vec3d specular = k_s;
+                    specular%=color;
+                    lit += specular * std::pow(std::max(ray_normal,0.0),shine);
+                }
+                if(queue)
+                {
+                    queue->push(point, intsec, i.obj, lit * (point->distanceAttenuation(intsec) * weight));
+                    return;
+                }
+                shadow = point->shadowAttenuation(intsec, i.obj);
+                shadow %= lit;
             }
-                Vec3d diffuse = kd(i);
-                Vec3d specular = ks(i);
-                diffuse%=point->getColor(intsec);
-                specular%=point->getColor(intsec);
-                shadow = point->shadowAttenuation(intsec);
-                shadow %= (diffuse * std::max(light_normal, 0.0) + specular * std::pow(std::max(ray_normal,0.0),shininess(i)));
-            }
-            intensity += shadow*point->distanceAttenuation(intsec);
+            intensity += shadow*(point->distanceAttenuation(intsec) * weight);
+    };
+
+    if(!cacheable || !ShadingCache::get(i.obj, intsec, i.t * settings.pixelSpread, intensity))
+    {
+        shadeLights(scene, settings, intsec, shadeLight);
+        if(cacheable)
+            ShadingCache::put(intensity);
     }
+    if(cacheable && !NPR)
+        intensity %= k_d;
     return (intensity + e_intensity + a_intensity);
 }
 
+// Work out which terms of the material matter.  A term is zero only if
+// it's an untextured (0,0,0); anything textured has to be assumed live.
+void Material::compile()
+{
+    const MaterialParameter* terms[] = { &_ke, &_ka, &_ks, &_kd, &_kr, &_kt };
+    const unsigned int bits[] = { TERM_EMISSIVE, TERM_AMBIENT, TERM_SPECULAR,
+        TERM_DIFFUSE, TERM_REFLECTIVE, TERM_TRANSMISSIVE };
+    _nonzero = 0;
+    _textured = 0;
+    for( int t = 0; t < 6; ++t )
+    {
+        if( !terms[t]->isZero() )
+            _nonzero |= bits[t];
+        if( terms[t]->mapped() )
+            _textured |= bits[t];
+    }
+    if( _bump.bumpMapped() )
+    {
+        _nonzero |= TERM_BUMP;
+        _textured |= TERM_BUMP;
+    }
+    if( !_shininess.isZero() )
+        _nonzero |= TERM_SHININESS;
+    if( _shininess.mapped() )
+        _textured |= TERM_SHININESS;
+    else
+        _constShininess = _shininess.intensityValue( isect() );
+}
+
+template Vec3d Material::shade<false, false>( Scene*, const ray&, const isect&, const RenderSettings& ) const;
+template Vec3d Material::shade<false, true>( Scene*, const ray&, const isect&, const RenderSettings& ) const;
+template Vec3d Material::shade<true, false>( Scene*, const ray&, const isect&, const RenderSettings& ) const;
+template Vec3d Material::shade<true, true>( Scene*, const ray&, const isect&, const RenderSettings& ) const;
+
 TextureMap::TextureMap(string filename) {
 
 	int start = filename.find_last_of('.');
@@ -14,6 +14,7 @@
 class Scene;
 class ray;
 class isect;
+struct RenderSettings;
 
 using std::string;
 
@@ -176,6 +177,13 @@ public:
 	// Use this to determine if the particular parameter is
 	// mapped; use this to determine if we need to somehow renormalize.
 	bool mapped() const { return _textureMap != 0; }
+	bool bumpMapped() const { return _bumpMap != 0; }
+
+	// True if value() is (0,0,0) wherever it's evaluated.
+	bool isZero() const
+	{
+		return _textureMap == 0 && _value[0] == 0.0 && _value[1] == 0.0 && _value[2] == 0.0;
+	}
 
 private:
     Vec3d _value;
@@ -195,14 +203,19 @@ public:
         , _kr( Vec3d( 0.0, 0.0, 0.0 ) )
         , _kt( Vec3d( 0.0, 0.0, 0.0 ) )
         , _shininess( 0.0 ) 
-		, _index(1.0) {}
+		, _index(1.0) { compile(); }
 
     Material( const Vec3d& e, const Vec3d& a, const Vec3d& s, 
               const Vec3d& d, const Vec3d& r, const Vec3d& t, double sh, double in)
         : _ke( e ), _ka( a ), _ks( s ), _kd( d ), _kr( r ), _kt( t ), 
-          _shininess( Vec3d(sh,sh,sh) ), _index( Vec3d(in,in,in) ) {}
+          _shininess( Vec3d(sh,sh,sh) ), _index( Vec3d(in,in,in) ) { compile(); }
 
-	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i ) const;
+	// Shade a hit under the render's settings: NPR selects cool-to-warm
+	// shading instead of Phong, and BUMP is false when nothing in the scene
+	// is bump mapped.  RayTracer picks the instantiation once per render;
+	// the four combinations are instantiated in material.cpp.
+	template<bool NPR, bool BUMP>
+	Vec3d shade( Scene *scene, const ray& r, const isect& i, const RenderSettings& settings ) const;
 
 
     
@@ -217,6 +230,7 @@ public:
         _kt += m._kt;
         _index += m._index;
         _shininess += m._shininess;
+        compile();
         return *this;
     }
 
@@ -244,29 +258,56 @@ public:
     double index( const isect& i ) const { return _index.intensityValue(i); }
 
     // setting functions accepting primitives (Vec3d and double)
-    void setEmissive( const Vec3d& ke )     { _ke.setValue( ke ); }
-    void setAmbient( const Vec3d& ka )      { _ka.setValue( ka ); }
-    void setSpecular( const Vec3d& ks )     { _ks.setValue( ks ); }
-    void setDiffuse( const Vec3d& kd )      { _kd.setValue( kd ); }
-    void setReflective( const Vec3d& kr )   { _kr.setValue( kr ); }
-    void setTransmissive( const Vec3d& kt ) { _kt.setValue( kt ); }
+    void setEmissive( const Vec3d& ke )     { _ke.setValue( ke ); compile(); }
+    void setAmbient( const Vec3d& ka )      { _ka.setValue( ka ); compile(); }
+    void setSpecular( const Vec3d& ks )     { _ks.setValue( ks ); compile(); }
+    void setDiffuse( const Vec3d& kd )      { _kd.setValue( kd ); compile(); }
+    void setReflective( const Vec3d& kr )   { _kr.setValue( kr ); compile(); }
+    void setTransmissive( const Vec3d& kt ) { _kt.setValue( kt ); compile(); }
     void setShininess( double shininess )   
-                                            { _shininess.setValue( shininess ); }
-    void setIndex( double index )           { _index.setValue( index ); }
+                                            { _shininess.setValue( shininess ); compile(); }
+    void setIndex( double index )           { _index.setValue( index ); compile(); }
 
 
     // setting functions taking MaterialParameters
-    void setEmissive( const MaterialParameter& ke )            { _ke = ke; }
-    void setAmbient( const MaterialParameter& ka )             { _ka = ka; }
-    void setSpecular( const MaterialParameter& ks )            { _ks = ks; }
-    void setDiffuse( const MaterialParameter& kd )             { _kd = kd; }
-    void setReflective( const MaterialParameter& kr )          { _kr = kr; }
-    void setTransmissive( const MaterialParameter& kt )        { _kt = kt; }
+    void setEmissive( const MaterialParameter& ke )            { _ke = ke; compile(); }
+    void setAmbient( const MaterialParameter& ka )             { _ka = ka; compile(); }
+    void setSpecular( const MaterialParameter& ks )            { _ks = ks; compile(); }
+    void setDiffuse( const MaterialParameter& kd )             { _kd = kd; compile(); }
+    void setReflective( const MaterialParameter& kr )          { _kr = kr; compile(); }
+    void setTransmissive( const MaterialParameter& kt )        { _kt = kt; compile(); }
     void setShininess( const MaterialParameter& shininess )    
-                                                               { _shininess = shininess; }
-    void setIndex( const MaterialParameter& index )            { _index = index; }
-    void setBumpMapping( const MaterialParameter& bump )             { _bump = bump; }
+                                                               { _shininess = shininess; compile(); }
+    void setIndex( const MaterialParameter& index )            { _index = index; compile(); }
+    void setBumpMapping( const MaterialParameter& bump )             { _bump = bump; compile(); }
+
+    // Terms of the shading model, as bits in the masks below.
+    enum Term
+    {
+        TERM_EMISSIVE       = 1 << 0,
+        TERM_AMBIENT        = 1 << 1,
+        TERM_SPECULAR       = 1 << 2,
+        TERM_DIFFUSE        = 1 << 3,
+        TERM_REFLECTIVE     = 1 << 4,
+        TERM_TRANSMISSIVE   = 1 << 5,
+        TERM_BUMP           = 1 << 6,
+        TERM_SHININESS      = 1 << 7
+    };
+
+    // Which terms may be nonzero, and which are looked up in a texture.
+    // Both are recomputed by every setter, so shade() can skip the terms
+    // that are zero and only evaluate the textured ones per hit.
+    unsigned int nonzeroTerms() const { return _nonzero; }
+    unsigned int texturedTerms() const { return _textured; }
+    bool hasTerm( unsigned int terms ) const { return (_nonzero & terms) != 0; }
+
 private:
+    void compile();
+
+    unsigned int _nonzero;
+    unsigned int _textured;
+    double _constShininess;                   // shininess when it isn't textured
+
     MaterialParameter _ke;                    // emissive
     MaterialParameter _ka;                    // ambient
     MaterialParameter _ks;                    // specular
@@ -293,6 +334,7 @@ operator*( double d, Material m )
     m._kt *= d;
     m._index *= d;
     m._shininess *= d;
+    m.compile();
     return m;
 }
 
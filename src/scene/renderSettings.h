@@ -0,0 +1,66 @@
+//
+// renderSettings.h
+//
+// The settings a render runs with, copied out of the TraceUI once per
+// image.
+//
+
+#ifndef __RENDER_SETTINGS_H__
+#define __RENDER_SETTINGS_H__
+
+#include <cstddef>
+
+class CubeMap;
+
+// RayTracer::traceSetup() fills one of these in from the UI (and the
+// scene) before any pixel is traced, and everything below it reads this
+// copy instead of the TraceUI.  The UI can change its widgets while a
+// render is running, and worker threads must never see a half-updated
+// configuration.  The flags also pick the RayTracer's trace kernel, so
+// most of them never get tested per ray at all.
+struct RenderSettings
+{
+	int depth;                  // max depth of recursion
+	int sampleSize;             // super sample size
+	bool jitter;
+	bool adaptiveSampling;
+	double adaptiveThreshold;   // standard error of a pixel's brightness to stop sampling at
+	bool sharedSamples;         // supersample on a lattice shared between pixels
+	bool edgeRedraw;            // trace at 1 spp, then supersample the edges found
+	float depthThreshold;       // edge: relative depth jump between neighbours
+	float angleThresholdA;      // edge: change in view angle cosine between neighbours
+	float angleThresholdB;      // edge: cosine between neighbours' normals below this
+	bool denoise;               // filter the finished image, guided by the G-buffer
+	int reduction;              // shade one pixel in reduction x reduction, then upsample
+	float exposure;             // stops to brighten by before tone mapping
+	int toneMap;                // FrameBuffer::ToneMap for the 8-bit image
+	bool accelerate;            // trace through the acceleration structure
+	int accelStructure;         // AccelStructure actually built for the scene
+	bool nonRealism;            // cool-to-warm shading instead of Phong
+	bool bumpMapping;           // some material in the scene is bump mapped
+	float bumpScale;
+	const CubeMap* cubeMap;     // environment for rays that escape, or NULL
+	double rayThreshold;        // min weight (throughput * kr or kt) to spawn a ray
+	int rouletteDepth;          // Russian roulette from this depth on, -1 for never
+	double lightCutoff;         // skip lights contributing less than this (0: visit all)
+	int lightBudget;            // max lights shaded per hit, sampled by importance (0: all)
+	bool occluderCache;         // test each light's last shadow blocker first
+	int shadowMapRes;           // side of each light's shadow map (0: no maps)
+	bool shadingCache;          // share diffuse lighting between nearby primary hits
+	bool hitCache;              // replay primary hits kept from the last render of the view
+	double pixelSpread;         // width of a pixel one unit from the eye
+
+	RenderSettings()
+		: depth( 0 ), sampleSize( 1 ), jitter( false ), adaptiveSampling( false ),
+		adaptiveThreshold( 0.0 ), sharedSamples( false ), edgeRedraw( false ),
+		depthThreshold( 0.0f ), angleThresholdA( 0.0f ), angleThresholdB( 0.0f ),
+		denoise( false ), reduction( 1 ), exposure( 0.0f ), toneMap( 0 ),
+		accelerate( false ), accelStructure( 0 ), nonRealism( false ),
+		bumpMapping( false ), bumpScale( 0.0f ), cubeMap( NULL ),
+		rayThreshold( 0.0 ), rouletteDepth( -1 ), lightCutoff( 0.0 ), lightBudget( 0 ),
+		occluderCache( false ), shadowMapRes( 0 ), shadingCache( false ),
+		hitCache( false ), pixelSpread( 0.0 )
+	{ }
+};
+
+#endif // __RENDER_SETTINGS_H__
@@ -0,0 +1,75 @@
+#include "sampler.h"
+
+namespace {
+	// 32-bit integer finaliser (Wellons' lowbias32), used to turn pixel
+	// coordinates into well spread seeds.
+	uint32_t mix( uint32_t h )
+	{
+		h ^= h >> 16;
+		h *= 0x7feb352d;
+		h ^= h >> 15;
+		h *= 0x846ca68b;
+		h ^= h >> 16;
+		return h;
+	}
+
+	// Point index of the first two Sobol dimensions as 32-bit fractions.
+	// The first dimension is the van der Corput sequence; the second's
+	// direction numbers come from the polynomial x + 1.
+	void sobol2D( uint32_t index, uint32_t& x, uint32_t& y )
+	{
+		x = 0;
+		y = 0;
+		uint32_t v = 0x80000000u;
+		for( int bit = 0; index != 0; ++bit, index >>= 1 )
+		{
+			if( index & 1 )
+			{
+				x ^= 0x80000000u >> bit;
+				y ^= v;
+			}
+			v ^= v >> 1;
+		}
+	}
+}
+
+void Pcg32::seed( uint64_t initState, uint64_t stream )
+{
+	state = 0;
+	inc = ( stream << 1 ) | 1;
+	next();
+	state += initState;
+	next();
+}
+
+uint32_t Pcg32::next()
+{
+	uint64_t old = state;
+	state = old * 6364136223846793005ULL + inc;
+	uint32_t xorShifted = (uint32_t)( ( ( old >> 18 ) ^ old ) >> 27 );
+	uint32_t rot = (uint32_t)( old >> 59 );
+	return ( xorShifted >> rot ) | ( xorShifted << ( ( 32 - rot ) & 31 ) );
+}
+
+Sampler& Sampler::current()
+{
+	static thread_local Sampler sampler;
+	return sampler;
+}
+
+void Sampler::startSample( int x, int y, int i )
+{
+	uint32_t pixel = mix( (uint32_t)x + mix( (uint32_t)y ) );
+	index = (uint32_t)i;
+	shift[0] = mix( pixel ^ 0x68e31da4u );
+	shift[1] = mix( pixel ^ 0xb5297a4du );
+	rng.seed( ( (uint64_t)pixel << 32 ) | index, pixel );
+}
+
+void Sampler::pixelSample( double& u, double& v ) const
+{
+	uint32_t x, y;
+	sobol2D( index, x, y );
+	u = ( x ^ shift[0] ) * ( 1.0 / 4294967296.0 );
+	v = ( y ^ shift[1] ) * ( 1.0 / 4294967296.0 );
+}
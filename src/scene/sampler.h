@@ -0,0 +1,66 @@
+//
+// sampler.h
+//
+// Random and low-discrepancy numbers for the renderer, seeded per pixel
+// sample so that images don't depend on the order pixels are traced in.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <stdint.h>
+
+// O'Neill's PCG32 (XSH RR): 64 bits of state, a stream selector, and
+// much better numbers than rand() at the cost of a multiply-add.
+class Pcg32
+{
+public:
+	Pcg32() { seed( 0, 0 ); }
+
+	void seed( uint64_t initState, uint64_t stream );
+	uint32_t next();
+	// Uniform in [0, 1).
+	double nextDouble() { return next() * ( 1.0 / 4294967296.0 ); }
+
+private:
+	uint64_t state;
+	uint64_t inc;
+};
+
+// Everything random in a render draws from the calling thread's sampler,
+// which the RayTracer restarts before tracing each primary sample.  The
+// numbers a sample sees then depend only on its pixel and index, never on
+// which thread traced it or what was traced before, so renders are
+// reproducible whatever the thread count.
+//
+// A sample's position in its pixel comes from the first two dimensions of
+// the Sobol sequence, scrambled with a random digital shift per pixel: any
+// 2^k samples of a pixel fall one to each of its elementary strata, and
+// neighbouring pixels don't share a pattern.  Everything else (Russian
+// roulette, light selection, area light samples) takes numbers from a PCG
+// stream keyed on the pixel and sample index.
+class Sampler
+{
+public:
+	// The calling thread's sampler.
+	static Sampler& current();
+
+	// Start sample index of pixel (x, y).
+	void startSample( int x, int y, int index );
+
+	// Index of the current sample in its pixel.
+	int sampleIndex() const { return (int)index; }
+
+	// The current sample's position in its pixel, in [0, 1)^2.
+	void pixelSample( double& u, double& v ) const;
+
+	// The next number of the current sample's stream, in [0, 1).
+	double next() { return rng.nextDouble(); }
+
+private:
+	Pcg32 rng;
+	uint32_t index;
+	uint32_t shift[2];
+};
+
+#endif // __SAMPLER_H__
@@ -7,26 +7,11 @@ extern TraceUI* traceUI;
 
 using namespace std;
 
-bool Geometry::intersect(const ray&r, isect&i) const {
-	double tmin, tmax;
-	if (hasBoundingBoxCapability() && !(bounds.intersect(r, tmin, tmax))) return false;
-	// Transform the ray into the object's local coordinate space
-    Vec3d pos = transform->globalToLocalCoords(r.getPosition());
-    Vec3d dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    //dir -- direction from camera in local coordinates pointing towards object
-    //pos -- point on camera wrt local coordinate frame
-	double length = dir.length();
-//	dir /= length;
-    dir.normalize();
-
-    ray localRay( pos, dir, r.type() ); //Ray from camera to object in local coordinate frame
+extern bool debugMode;
 
-	if (intersectLocal(localRay, i)) {
-		// Transform the intersection point & normal returned back into global space.
-        i.N = transform->localToGlobalCoordsNormal(i.N);
-        i.t /= length;
-		return true;
-	} else return false;
+bool Geometry::intersect(const ray&r, isect&i) const {
+	return intersectTransformed(r, i, hasBoundingBoxCapability(),
+		[this](const ray& localRay, isect& li) { return intersectLocal(localRay, li); });
 }
 
 bool Geometry::hasBoundingBoxCapability() const {
@@ -49,9 +34,19 @@ Scene::~Scene() {
 	for( t = textureCache.begin(); t != textureCache.end(); t++ ) delete (*t).second;
 }
 
+void Scene::add( Light* light ) {
+	light->setIndex( lights.size() );
+	lights.push_back( light );
+}
+
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect( const ray& r, isect& i ) const {
+	const Geometry* hitObject;
+	return intersect( r, i, hitObject );
+}
+
+bool Scene::intersect( const ray& r, isect& i, const Geometry*& hitObject ) const {
 	double tmin = 0.0;
 	double tmax = 0.0;
 	bool have_one = false;
@@ -61,16 +56,27 @@ bool Scene::intersect( const ray& r, isect& i ) const {
 		if( (*j)->intersect( r, cur ) ) {
 			if( !have_one || (cur.t < i.t) ) {
 				i = cur;
+				hitObject = *j;
 				have_one = true;
 			}
 		}
 	}
-	if( !have_one ) i.setT(1000.0);
-	// if debugging,
-	intersectCache.push_back( std::make_pair(r,i) );
+	if( !have_one ) { i.setT(1000.0); hitObject = NULL; }
+	// Only kept while debugging a single pixel: it isn't thread safe, and
+	// over a whole render it just grows.
+	if( debugMode )
+		intersectCache.push_back( std::make_pair(r,i) );
 	return have_one;
 }
 
+void Scene::updateBounds() {
+	sceneBounds = BoundingBox();
+	for( giter g = objects.begin(); g != objects.end(); ++g ) {
+		(*g)->ComputeBoundingBox();
+		sceneBounds.merge( (*g)->getBoundingBox() );
+	}
+}
+
 TextureMap* Scene::getTexture( string name ) {
 	tmap::const_iterator itr = textureCache.find( name );
 	if( itr == textureCache.end() ) {
@@ -20,6 +20,8 @@
 #include "material.h"
 #include "camera.h"
 #include "bbox.h"
+#include "renderSettings.h"
+#include "lightTree.h"
 
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
@@ -49,7 +51,8 @@ class TransformNode {
 protected:
 
 	// information about this node's transformation
-	Mat4d    xform;
+	Mat4d    local;		// relative to the parent
+	Mat4d    xform;		// local-to-world
 	Mat4d    inverse;
 	Mat3d    normi;
 
@@ -85,17 +88,33 @@ public:
 	}
 
 	const Mat4d& transform() const		{ return xform; }
+	const Mat4d& localTransform() const	{ return local; }
+
+	// Replace this node's transformation (relative to its parent) and
+	// propagate the change down to every descendant.  Object bounds and
+	// acceleration structures are not touched; call
+	// RayTracer::updateTransforms() once all nodes have been updated.
+	void setLocalTransform(const Mat4d& m) {
+		local = m;
+		update();
+	}
 
 protected:
+	void update() {
+		if (parent == NULL) this->xform = local;
+		else this->xform = parent->xform * local;
+		inverse = this->xform.inverse();
+		normi = this->xform.upper33().inverse().transpose();
+		for(child_iter c = children.begin(); c != children.end(); ++c ) (*c)->update();
+	}
+
 	// protected so that users can't directly construct one of these...
 	// force them to use the createChild() method.  Note that they CAN
 	// directly create a TransformRoot object.
 	TransformNode(TransformNode *parent, const Mat4d& xform ) : children() {
 		this->parent = parent;
-		if (parent == NULL) this->xform = xform;
-		else this->xform = parent->xform * xform;  
-		inverse = this->xform.inverse();
-		normi = this->xform.upper33().inverse().transpose();
+		this->local = xform;
+		update();
 	}
 };
 
@@ -104,6 +123,20 @@ public:
 	TransformRoot() : TransformNode(NULL, Mat4d()) {}
 };
 
+// Concrete geometry types, so that code which only ever sees Geometry*
+// (such as the scene-level k-d tree) can switch on the type instead of
+// paying for virtual calls.  See GeometryTraits.
+enum GeometryKind
+{
+	GEOM_OTHER,
+	GEOM_SPHERE,
+	GEOM_BOX,
+	GEOM_SQUARE,
+	GEOM_CYLINDER,
+	GEOM_CONE,
+	GEOM_TRIMESH
+};
+
 // A Geometry object is anything that has extent in three dimensions.
 // It may not be an actual visible scene object.  For example, hierarchical
 // spatial subdivision could be expressed in terms of Geometry instances.
@@ -118,6 +151,33 @@ public:
 	// intersections performed in the global coordinate space.
 	bool intersect(const ray&r, isect&i) const;
 
+	// The body of intersect(), with the local-space test passed in as a
+	// functor.  Callers that already know the concrete type can hand in a
+	// non-virtual call to its intersectLocal().
+	template<typename LocalTest>
+	bool intersectTransformed(const ray&r, isect&i, bool bounded, LocalTest localTest) const {
+		double tmin, tmax;
+		if (bounded && !(bounds.intersect(r, tmin, tmax))) return false;
+		// Transform the ray into the object's local coordinate space
+		Vec3d pos = transform->globalToLocalCoords(r.getPosition());
+		Vec3d dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
+		//dir -- direction from camera in local coordinates pointing towards object
+		//pos -- point on camera wrt local coordinate frame
+		double length = dir.length();
+		dir.normalize();
+
+		ray localRay( pos, dir, r.type() ); //Ray from camera to object in local coordinate frame
+
+		if (localTest(localRay, i)) {
+			// Transform the intersection point & normal returned back into global space.
+			i.N = transform->localToGlobalCoordsNormal(i.N);
+			i.t /= length;
+			return true;
+		} else return false;
+	}
+
+	GeometryKind geometryKind() const { return kind; }
+
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
 	Vec3d getNormal() { return Vec3d(1.0, 0.0, 0.0); }
@@ -167,8 +227,9 @@ public:
 	virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
     void setTransform(TransformNode *transform) { this->transform = transform; }
+    TransformNode *getTransform() const { return transform; }
 
-	Geometry(Scene *scene) : SceneElement( scene ) {}
+	Geometry(Scene *scene) : SceneElement( scene ), kind( GEOM_OTHER ) {}
 
 	// For debugging purposes, draws using OpenGL
 	void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
@@ -180,6 +241,7 @@ public:
 protected:
 	BoundingBox bounds;
 	TransformNode *transform;
+	GeometryKind kind;		// set by the concrete subclass' constructor
 };
 
 // A SceneObject is a real actual thing that we want to model in the 
@@ -223,7 +285,7 @@ public:
 	typedef std::vector<Geometry*>::iterator giter;
 	typedef std::vector<Geometry*>::const_iterator cgiter;
 	TransformRoot transformRoot;
-	Scene() : transformRoot(), objects(), lights() {}
+	Scene() : transformRoot(), objects(), lights(), accelHint( -1 ) {}
 	virtual ~Scene();
 
 	void add( Geometry* obj ) {
@@ -231,9 +293,15 @@ public:
 		sceneBounds.merge(obj->getBoundingBox());
 		objects.push_back( obj );
 	}
-	void add( Light* light ) { lights.push_back( light ); }
+	void add( Light* light );
 
 	bool intersect( const ray& r, isect& i ) const;
+	// As above, also returning the top-level object that was hit.
+	bool intersect( const ray& r, isect& i, const Geometry*& hitObject ) const;
+
+	// Recompute every object's world-space bounds (and the scene bounds)
+	// after TransformNode matrices have changed.
+	void updateBounds();
 
 	std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -261,6 +329,25 @@ public:
 
 	const BoundingBox& bounds() const { return sceneBounds; }
 
+	// Acceleration structure asked for by the scene file (an AccelStructure
+	// value from TraceUI.h), or -1 to leave the choice to the UI.
+	int acceleratorHint() const { return accelHint; }
+	void setAcceleratorHint( int a ) { accelHint = a; }
+
+	int numObjects() const { return objects.size(); }
+	int numLights() const { return lights.size(); }
+	bool hasBumpMaps() const { return !bumpCache.empty(); }
+
+	// Light culling for shading.  The tree is only built when the render
+	// asks for a cutoff; otherwise every light is visited.
+	const LightTree& lightTree() const { return lightBVH; }
+	void buildLightTree( double cutoff ) { lightBVH.build( lights.begin(), lights.end(), cutoff ); }
+	void clearLightTree() { lightBVH.clear(); }
+
+	// Settings of the render in progress; set by RayTracer::traceSetup().
+	const RenderSettings& renderSettings() const { return settings; }
+	void setRenderSettings( const RenderSettings& s ) { settings = s; }
+
 private:
 	std::vector<Geometry*> objects;
 	std::vector<Geometry*> nonboundedobjects;
@@ -282,6 +369,10 @@ private:
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
 
+	int accelHint;
+	RenderSettings settings;
+	LightTree lightBVH;
+
 public:
 	// This is used for debugging purposes only.
 	mutable std::vector< std::pair<ray, isect> > intersectCache;
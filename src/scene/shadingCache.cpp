@@ -0,0 +1,105 @@
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
+
+#include "shadingCache.h"
+
+using namespace std;
+
+namespace {
+	// Entries per thread before the cache starts over.  Samples share
+	// cells with their near neighbours only, so old entries are rarely
+	// needed again.
+	const size_t MAX_ENTRIES = 1 << 16;
+
+	std::atomic<unsigned int> cacheEpoch( 1 );
+	std::atomic<unsigned long long> cacheLookups( 0 );
+	std::atomic<unsigned long long> cacheHits( 0 );
+
+	struct Key
+	{
+		const SceneObject* obj;
+		long long x, y, z;
+		int level;
+
+		bool operator==( const Key& other ) const
+		{
+			return obj == other.obj && x == other.x && y == other.y &&
+				z == other.z && level == other.level;
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()( const Key& k ) const
+		{
+			size_t h = hash<const void*>()( k.obj );
+			const long long parts[4] = { k.x, k.y, k.z, k.level };
+			for( int n = 0; n < 4; ++n )
+				h = (h ^ hash<long long>()( parts[n] )) * 1099511628211ULL;
+			return h;
+		}
+	};
+
+	struct ThreadCache
+	{
+		unsigned int epoch;
+		unordered_map<Key, Vec3d, KeyHash> entries;
+		Key pending;
+	};
+
+	ThreadCache& threadCache()
+	{
+		thread_local ThreadCache cache;
+		unsigned int epoch = cacheEpoch.load( std::memory_order_relaxed );
+		if( cache.epoch != epoch || cache.entries.size() >= MAX_ENTRIES )
+		{
+			cache.entries.clear();
+			cache.epoch = epoch;
+		}
+		return cache;
+	}
+}
+
+bool ShadingCache::get( const SceneObject* obj, const Vec3d& P, double spread, Vec3d& lighting )
+{
+	ThreadCache& cache = threadCache();
+	Key& key = cache.pending;
+	key.obj = obj;
+	key.level = (int)ceil( log2( max( spread, 1.0e-12 ) ) );
+	double inverse = ldexp( 1.0, -key.level );
+	key.x = (long long)floor( P[0] * inverse );
+	key.y = (long long)floor( P[1] * inverse );
+	key.z = (long long)floor( P[2] * inverse );
+
+	cacheLookups.fetch_add( 1, std::memory_order_relaxed );
+	unordered_map<Key, Vec3d, KeyHash>::const_iterator found = cache.entries.find( key );
+	if( found == cache.entries.end() )
+		return false;
+	cacheHits.fetch_add( 1, std::memory_order_relaxed );
+	lighting = found->second;
+	return true;
+}
+
+void ShadingCache::put( const Vec3d& lighting )
+{
+	ThreadCache& cache = threadCache();
+	cache.entries[cache.pending] = lighting;
+}
+
+void ShadingCache::reset()
+{
+	cacheEpoch.fetch_add( 1, std::memory_order_relaxed );
+	cacheLookups.store( 0, std::memory_order_relaxed );
+	cacheHits.store( 0, std::memory_order_relaxed );
+}
+
+void ShadingCache::clearThread()
+{
+	ThreadCache& cache = threadCache();
+	if( !cache.entries.empty() )
+		unordered_map<Key, Vec3d, KeyHash>().swap( cache.entries );
+}
+
+unsigned long long ShadingCache::lookups() { return cacheLookups.load( std::memory_order_relaxed ); }
+unsigned long long ShadingCache::hits() { return cacheHits.load( std::memory_order_relaxed ); }
@@ -0,0 +1,51 @@
+//
+// shadingCache.h
+//
+// Direct lighting of primary hits, shared between the samples that land
+// close together on the same primitive.
+//
+
+#ifndef __SHADING_CACHE_H__
+#define __SHADING_CACHE_H__
+
+#include "../vecmath/vec.h"
+
+class SceneObject;
+
+// When a pixel is supersampled, most of its samples hit the same surface
+// a fraction of a pixel apart, and shading each of them runs the whole
+// light loop with its shadow rays again.  The cache keys the light loop's
+// result on the primitive hit and its position snapped to a grid about
+// one pixel footprint wide (a power of two, so samples at slightly
+// different distances still agree), and hands it to every later sample
+// in the same cell, in this pixel or a neighbouring one.  Visibility is
+// still sampled at full rate; only lighting is shared.
+//
+// Only view-independent lighting can be shared, so Material::shade()
+// only uses the cache for primary hits on materials without a specular
+// term, and stores the light arriving before k_d is applied, so textures
+// are still sampled at full rate.  Bump mapped materials, and NPR shading
+// of textured ones, aren't cached.  Each thread has its own cache.
+class ShadingCache
+{
+public:
+	// Look up the lighting at P on obj for a pixel footprint of spread
+	// there.  On a miss, returns false and remembers the key, so put()
+	// can store the value once it is computed.
+	static bool get( const SceneObject* obj, const Vec3d& P, double spread, Vec3d& lighting );
+	static void put( const Vec3d& lighting );
+
+	// Empty every thread's cache and zero the counters.  Call before a
+	// render starts.
+	static void reset();
+
+	// Empty the calling thread's cache.  The tracer calls this before
+	// each tile or pixel it hands a thread, so what gets shared never
+	// depends on what that thread happened to trace before.
+	static void clearThread();
+
+	static unsigned long long lookups();
+	static unsigned long long hits();
+};
+
+#endif // __SHADING_CACHE_H__
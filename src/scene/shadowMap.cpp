@@ -0,0 +1,231 @@
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+
+#include "shadowMap.h"
+#include "scene.h"
+#include "../parallel.h"
+
+using namespace std;
+
+namespace {
+	std::atomic<unsigned long long> mapLookups( 0 );
+	std::atomic<unsigned long long> mapResolved( 0 );
+
+	// Depth tolerance, in texels.
+	const double TOLERANCE_TEXELS = 2.0;
+	// Slack for rounding when comparing a point with the depths it was
+	// sampled at.
+	const double DEPTH_EPSILON = 1.0e-4;
+}
+
+void ShadowMap::clear()
+{
+	res = 0;
+	faces = 0;
+	vector<Texel>().swap( texels );
+}
+
+template<typename RayFor>
+void ShadowMap::build( const Scene* scene, int resolution, int numFaces, RayFor rayFor )
+{
+	res = resolution;
+	faces = numFaces;
+	int side = res + 1;
+
+	auto sample = [&]( int face, double s, double t, Texel& hit ) {
+		ray r = rayFor( face, s, t );
+		isect i;
+		hit.minDepth = hit.maxDepth = FLT_MAX;
+		hit.object = NULL;
+		hit.surface = NULL;
+		hit.opaque = false;
+		if( scene->intersect( r, i, hit.object ) )
+		{
+			hit.surface = i.obj;
+			Vec3d kTransmit = i.getMaterial().kt( i );
+			hit.minDepth = hit.maxDepth = (float)i.t;
+			hit.opaque = kTransmit[0] <= 0 && kTransmit[1] <= 0 && kTransmit[2] <= 0;
+		}
+	};
+	auto merge = []( Texel& texel, const Texel& other ) {
+		texel.minDepth = min( texel.minDepth, other.minDepth );
+		texel.maxDepth = max( texel.maxDepth, other.maxDepth );
+		if( other.object != texel.object )
+			texel.object = NULL;
+		if( other.surface != texel.surface )
+			texel.surface = NULL;
+		texel.opaque = texel.opaque && other.opaque;
+	};
+
+	// Corners are shared by up to four texels, so cast them first.
+	vector<Texel> corners( faces * side * side );
+	parallelChunks( 0, faces * side, [&]( int b, int e, unsigned int ) {
+		for( int row = b; row < e; ++row )
+		{
+			int face = row / side;
+			int t = row % side;
+			for( int s = 0; s < side; ++s )
+				sample( face, s, t, corners[row * side + s] );
+		}
+	} );
+
+	texels.resize( faces * res * res );
+	parallelChunks( 0, faces * res, [&]( int b, int e, unsigned int ) {
+		for( int row = b; row < e; ++row )
+		{
+			int face = row / res;
+			int t = row % res;
+			for( int s = 0; s < res; ++s )
+			{
+				Texel& texel = texels[row * res + s];
+				sample( face, s + 0.5, t + 0.5, texel );
+				int first = (face * side + t) * side + s;
+				merge( texel, corners[first] );
+				merge( texel, corners[first + 1] );
+				merge( texel, corners[first + side] );
+				merge( texel, corners[first + side + 1] );
+			}
+		}
+	} );
+
+	// Merge in the neighbours (within the face), so an edge that slips
+	// between one texel's samples still shows up through the next one's.
+	vector<Texel> own( texels );
+	parallelChunks( 0, faces * res, [&]( int b, int e, unsigned int ) {
+		for( int row = b; row < e; ++row )
+		{
+			int face = row / res;
+			int t = row % res;
+			for( int s = 0; s < res; ++s )
+			{
+				Texel& texel = texels[row * res + s];
+				for( int nt = max( t - 1, 0 ); nt <= min( t + 1, res - 1 ); ++nt )
+					for( int ns = max( s - 1, 0 ); ns <= min( s + 1, res - 1 ); ++ns )
+						merge( texel, own[(face * res + nt) * res + ns] );
+			}
+		}
+	} );
+}
+
+// Faces are +x, -x, +y, -y, +z, -z; face coordinates run along the next
+// two axes in turn.
+void ShadowMap::buildCube( const Scene* scene, const Vec3d& position, int resolution )
+{
+	cube = true;
+	origin = position;
+	build( scene, resolution, 6, [&]( int face, double s, double t ) {
+		int axis = face / 2;
+		Vec3d dir;
+		dir[axis] = (face % 2) ? -1.0 : 1.0;
+		dir[(axis + 1) % 3] = 2.0 * s / resolution - 1.0;
+		dir[(axis + 2) % 3] = 2.0 * t / resolution - 1.0;
+		dir.normalize();
+		return ray( position, dir, ray::SHADOW );
+	} );
+}
+
+// The map is a square on a plane just outside the scene bounds, facing
+// the light, big enough that the whole scene casts its shadow onto it.
+void ShadowMap::buildOrtho( const Scene* scene, const Vec3d& direction, int resolution )
+{
+	cube = false;
+	axisW = direction;
+	axisW.normalize();
+	Vec3d helper = fabs( axisW[0] ) < 0.9 ? Vec3d( 1, 0, 0 ) : Vec3d( 0, 1, 0 );
+	axisU = helper ^ axisW;
+	axisU.normalize();
+	axisV = axisW ^ axisU;
+
+	const BoundingBox& bounds = scene->bounds();
+	double lo[3] = { DBL_MAX, DBL_MAX, DBL_MAX };
+	double hi[3] = { -DBL_MAX, -DBL_MAX, -DBL_MAX };
+	for( int c = 0; c < 8; ++c )
+	{
+		Vec3d corner( (c & 1) ? bounds.getMax()[0] : bounds.getMin()[0],
+			(c & 2) ? bounds.getMax()[1] : bounds.getMin()[1],
+			(c & 4) ? bounds.getMax()[2] : bounds.getMin()[2] );
+		const Vec3d* axes[3] = { &axisU, &axisV, &axisW };
+		for( int a = 0; a < 3; ++a )
+		{
+			double d = corner * *axes[a];
+			lo[a] = min( lo[a], d );
+			hi[a] = max( hi[a], d );
+		}
+	}
+	double extent = max( hi[0] - lo[0], hi[1] - lo[1] );
+	double margin = 1.0e-3 * max( extent, hi[2] - lo[2] ) + RAY_EPSILON;
+	texelSize = (extent + 2.0 * margin) / resolution;
+	origin = (lo[0] - margin) * axisU + (lo[1] - margin) * axisV + (lo[2] - margin) * axisW;
+	build( scene, resolution, 1, [&]( int, double s, double t ) {
+		return ray( origin + (s * texelSize) * axisU + (t * texelSize) * axisV, axisW, ray::SHADOW );
+	} );
+}
+
+// A point no further than the one primitive every sample hit is only
+// known to be lit if it is on that primitive: anything else there (a
+// contact point, or one inside the primitive) may be behind it.
+ShadowMap::Visibility ShadowMap::classify( const Texel& texel, double depth, double tolerance,
+	const SceneObject* surface ) const
+{
+	double epsilon = DEPTH_EPSILON * depth + RAY_EPSILON;
+	if( depth < texel.minDepth - epsilon )
+		return LIT;
+	if( texel.object == NULL )
+		return AMBIGUOUS;
+	if( surface != NULL && texel.surface == surface &&
+		texel.maxDepth - texel.minDepth <= tolerance && depth <= texel.maxDepth + epsilon )
+		return LIT;
+	if( texel.opaque && depth > texel.maxDepth + tolerance )
+		return SHADOWED;
+	return AMBIGUOUS;
+}
+
+ShadowMap::Visibility ShadowMap::lookup( const Vec3d& P, const SceneObject* surface ) const
+{
+	mapLookups.fetch_add( 1, std::memory_order_relaxed );
+	Visibility visibility = AMBIGUOUS;
+	if( cube )
+	{
+		Vec3d v = P - origin;
+		int axis = 0;
+		if( fabs( v[1] ) > fabs( v[axis] ) ) axis = 1;
+		if( fabs( v[2] ) > fabs( v[axis] ) ) axis = 2;
+		double major = fabs( v[axis] );
+		if( major <= 0.0 )
+			return AMBIGUOUS;
+		int face = 2 * axis + (v[axis] < 0.0 ? 1 : 0);
+		int s = (int)((v[(axis + 1) % 3] / major + 1.0) * 0.5 * res);
+		int t = (int)((v[(axis + 2) % 3] / major + 1.0) * 0.5 * res);
+		s = max( 0, min( s, res - 1 ) );
+		t = max( 0, min( t, res - 1 ) );
+		double depth = v.length();
+		// A texel spans about 2 / res radians at the centre of a face, less
+		// towards its edges.
+		double tolerance = TOLERANCE_TEXELS * depth * 2.0 / res + RAY_EPSILON;
+		visibility = classify( texels[(face * res + t) * res + s], depth, tolerance, surface );
+	}
+	else
+	{
+		Vec3d q = P - origin;
+		double fs = (q * axisU) / texelSize;
+		double ft = (q * axisV) / texelSize;
+		double depth = q * axisW;
+		if( fs < 0.0 || ft < 0.0 || fs >= res || ft >= res || depth < 0.0 )
+			return AMBIGUOUS;
+		visibility = classify( texels[(int)ft * res + (int)fs], depth, TOLERANCE_TEXELS * texelSize + RAY_EPSILON,
+			surface );
+	}
+	if( visibility != AMBIGUOUS )
+		mapResolved.fetch_add( 1, std::memory_order_relaxed );
+	return visibility;
+}
+
+void ShadowMap::resetStats()
+{
+	mapLookups.store( 0, std::memory_order_relaxed );
+	mapResolved.store( 0, std::memory_order_relaxed );
+}
+
+unsigned long long ShadowMap::lookups() { return mapLookups.load( std::memory_order_relaxed ); }
+unsigned long long ShadowMap::resolved() { return mapResolved.load( std::memory_order_relaxed ); }
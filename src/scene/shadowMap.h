@@ -0,0 +1,83 @@
+//
+// shadowMap.h
+//
+// A depth map of the scene as seen from a light, used to settle shadow
+// queries without tracing a ray.
+//
+
+#ifndef __SHADOW_MAP_H__
+#define __SHADOW_MAP_H__
+
+#include <vector>
+
+#include "../vecmath/vec.h"
+
+class Scene;
+class Geometry;
+class SceneObject;
+
+// Rays are cast through the corners and centre of every texel.  Each
+// texel keeps the nearest and furthest first hit among its own samples
+// and its neighbours', and the object and primitive they all hit, if they
+// agree on one.  A point in front of every sample, or on the one
+// primitive the texel sees when that is the primitive being shaded, is
+// lit; a point well behind an opaque object that covers the texel is
+// shadowed.  Anything else (silhouettes,
+// contact shadows, transmissive blockers, surfaces at grazing angles) is
+// left to the shadow ray.  "Well behind" and "one surface" both mean
+// within two texels' worth of depth, so all the map can miss is
+// something thin enough to fall between the samples of a single texel.
+//
+// Point lights get a cube map around their position; directional lights
+// an orthographic map covering the scene bounds.  Maps are built once
+// and stay valid until the geometry moves.
+class ShadowMap
+{
+public:
+	enum Visibility { AMBIGUOUS, LIT, SHADOWED };
+
+	ShadowMap() : res( 0 ), faces( 0 ) {}
+
+	void buildCube( const Scene* scene, const Vec3d& position, int resolution );
+	void buildOrtho( const Scene* scene, const Vec3d& direction, int resolution );
+	void clear();
+	bool isBuilt() const { return res > 0; }
+	int resolution() const { return res; }
+
+	// Whether P, on the primitive surface (or NULL), is lit.
+	Visibility lookup( const Vec3d& P, const SceneObject* surface ) const;
+
+	// Lookups since the last resetStats(), and how many of them the map
+	// settled.
+	static void resetStats();
+	static unsigned long long lookups();
+	static unsigned long long resolved();
+
+private:
+	struct Texel
+	{
+		float minDepth;
+		float maxDepth;
+		const Geometry* object;     // what every sample hit, or NULL
+		const SceneObject* surface; // the primitive every sample hit, or NULL
+		bool opaque;
+	};
+
+	// Cast a ray through every texel corner and centre of every face;
+	// rayFor(face, s, t) gives the ray for face coordinates (s, t), in
+	// texels.
+	template<typename RayFor>
+	void build( const Scene* scene, int resolution, int numFaces, RayFor rayFor );
+	Visibility classify( const Texel& texel, double depth, double tolerance, const SceneObject* surface ) const;
+
+	int res;
+	int faces;
+	std::vector<Texel> texels;   // faces * res * res
+
+	bool cube;
+	Vec3d origin;                // light position, or the ortho map's corner
+	Vec3d axisU, axisV, axisW;   // ortho map basis; axisW points along the light
+	double texelSize;            // ortho texel side, in world units
+};
+
+#endif // __SHADOW_MAP_H__
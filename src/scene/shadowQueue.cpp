@@ -0,0 +1,63 @@
+#include "shadowQueue.h"
+#include "light.h"
+
+using namespace std;
+
+static thread_local ShadowQueue* activeQueue = NULL;
+
+ShadowQueue* ShadowQueue::active()
+{
+	return activeQueue;
+}
+
+void ShadowQueue::begin()
+{
+	requests.clear();
+	slot = 0;
+	throughput = Vec3d( 1.0, 1.0, 1.0 );
+	activeQueue = this;
+}
+
+void ShadowQueue::end()
+{
+	if( activeQueue == this )
+		activeQueue = NULL;
+}
+
+void ShadowQueue::push( const Light* light, const Vec3d& P, const SceneObject* surface, const Vec3d& contribution )
+{
+	Request r;
+	r.light = light;
+	r.P = P;
+	r.surface = surface;
+	r.contribution = contribution;
+	r.contribution %= throughput;
+	r.slot = slot;
+	requests.push_back( r );
+}
+
+// Group the requests by light with a counting sort on the light index,
+// which keeps each light's requests in the order they were queued.
+void ShadowQueue::resolve( vector<Vec3d>& out )
+{
+	int lights = 0;
+	for( vector<Request>::const_iterator r = requests.begin(); r != requests.end(); ++r )
+		lights = max( lights, r->light->getIndex() + 2 );
+	offsets.assign( lights + 1, 0 );
+	for( vector<Request>::const_iterator r = requests.begin(); r != requests.end(); ++r )
+		++offsets[r->light->getIndex() + 2];
+	for( int n = 1; n <= lights; ++n )
+		offsets[n] += offsets[n - 1];
+	// Lights outside a scene have index -1 and go first.
+	sorted.resize( requests.size() );
+	for( vector<Request>::const_iterator r = requests.begin(); r != requests.end(); ++r )
+		sorted[offsets[r->light->getIndex() + 1]++] = *r;
+
+	for( vector<Request>::const_iterator r = sorted.begin(); r != sorted.end(); ++r )
+	{
+		Vec3d shadow = r->light->shadowAttenuation( r->P, r->surface );
+		shadow %= r->contribution;
+		out[r->slot] += shadow;
+	}
+	requests.clear();
+}
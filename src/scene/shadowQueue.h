@@ -0,0 +1,68 @@
+//
+// shadowQueue.h
+//
+// Shadow rays collected while a tile is shaded, and traced afterwards in
+// batches, one light at a time.
+//
+
+#ifndef __SHADOW_QUEUE_H__
+#define __SHADOW_QUEUE_H__
+
+#include <vector>
+
+#include "../vecmath/vec.h"
+
+class Light;
+class SceneObject;
+
+// While a queue is active on a thread, Material::shade() doesn't trace
+// shadow rays: it pushes each light's unshadowed contribution, scaled by
+// the throughput of the ray being shaded, and leaves it out of the colour
+// it returns.  resolve() then traces the queued rays grouped by light, in
+// the order they were queued (so neighbouring pixels follow each other),
+// and adds contribution times shadow attenuation back into the slot each
+// request came from.  Consecutive rays to the same light walk the same
+// part of the acceleration structure and mostly end on the same occluder.
+class ShadowQueue
+{
+public:
+	ShadowQueue() : slot( 0 ), throughput( 1.0, 1.0, 1.0 ) {}
+
+	// The queue shading on this thread feeds, or NULL if shadow rays are
+	// traced as they come.
+	static ShadowQueue* active();
+
+	// Empty the queue and make it this thread's active queue, until end().
+	void begin();
+	void end();
+
+	// Requests pushed from now on belong to this slot, and are scaled by
+	// this throughput (set by the tracer before every shade).
+	void setSlot( int s ) { slot = s; }
+	void setThroughput( const Vec3d& t ) { throughput = t; }
+
+	void push( const Light* light, const Vec3d& P, const SceneObject* surface, const Vec3d& contribution );
+
+	// Trace everything queued and add the results into out[slot].
+	void resolve( std::vector<Vec3d>& out );
+
+	int size() const { return requests.size(); }
+
+private:
+	struct Request
+	{
+		const Light* light;
+		Vec3d P;
+		const SceneObject* surface;
+		Vec3d contribution;
+		int slot;
+	};
+
+	std::vector<Request> requests;
+	std::vector<Request> sorted;
+	std::vector<int> offsets;
+	int slot;
+	Vec3d throughput;
+};
+
+#endif // __SHADOW_QUEUE_H__
@@ -0,0 +1,89 @@
+#include "sharedImage.h"
+#include <fcntl.h>
+#include <new>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the sequence counter must be lock free to be shared");
+
+SharedImage::SharedImage():_base(NULL),_header(NULL),_bitmap(NULL){}
+
+SharedImage::~SharedImage()
+{
+    close();
+}
+
+bool SharedImage::create(const char* name, int width, int height, int tileSize)
+{
+    close();
+    uint32_t tilesX = (width + tileSize - 1) / tileSize;
+    uint32_t tilesY = (height + tileSize - 1) / tileSize;
+    // The bitmap in 32-bit words after the header, and the pixels on a
+    // cache line of their own.
+    uint64_t bitmapOffset = (sizeof(SharedImageHeader) + 7) & ~(uint64_t)7;
+    uint64_t bitmapWords = ((uint64_t)tilesX * tilesY + 31) / 32;
+    uint64_t pixelOffset = (bitmapOffset + bitmapWords * 4 + 63) & ~(uint64_t)63;
+    uint64_t size = pixelOffset + (uint64_t)width * height * 3;
+
+    int fd;
+    if(strchr(name, '/'))
+        fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    else
+        fd = shm_open((std::string("/") + name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return false;
+    void* base = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(base == MAP_FAILED)
+        return false;
+
+    // The file starts out zeroed, so the bitmap and pixels are clear.
+    _base = (unsigned char*)base;
+    _header = new(base) SharedImageHeader;
+    _bitmap = (uint32_t*)(_base + bitmapOffset);
+    memcpy(_header->magic, "RAYIMG1", 8);
+    _header->headerSize = sizeof(SharedImageHeader);
+    _header->format = SharedImageHeader::FORMAT_RGB8;
+    _header->width = width;
+    _header->height = height;
+    _header->tileSize = tileSize;
+    _header->tilesX = tilesX;
+    _header->tilesY = tilesY;
+    _header->finished = 0;
+    _header->bitmapOffset = bitmapOffset;
+    _header->pixelOffset = pixelOffset;
+    _header->mappingSize = size;
+    _header->sequence.store(0, std::memory_order_release);
+    return true;
+}
+
+void SharedImage::tileDone(int x, int y)
+{
+    uint64_t tile = (uint64_t)(y / _header->tileSize) * _header->tilesX + x / _header->tileSize;
+    _bitmap[tile / 32] |= 1u << (tile % 32);
+    changed();
+}
+
+void SharedImage::changed()
+{
+    _header->sequence.fetch_add(1, std::memory_order_release);
+}
+
+void SharedImage::finish()
+{
+    _header->finished = 1;
+    changed();
+}
+
+void SharedImage::close()
+{
+    if(_base)
+        munmap(_base, _header->mappingSize);
+    _base = NULL;
+    _header = NULL;
+    _bitmap = NULL;
+}
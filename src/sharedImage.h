@@ -0,0 +1,66 @@
+#ifndef SHAREDIMAGE_H
+#define SHAREDIMAGE_H
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+/* The 8-bit image of a render, placed in memory another process can map,
+   so a viewer or monitor can watch it fill in without the renderer
+   copying or writing anything.
+
+   The mapping starts with a SharedImageHeader.  A bitmap of finished
+   tiles, one bit per tile in row-major order, starts at bitmapOffset,
+   and the pixels at pixelOffset.  The renderer writes pixels, then sets
+   the bits of the tiles they complete, then bumps sequence (a release
+   store); a reader that loads sequence (acquire) sees everything written
+   before it, and can tell from an unchanged sequence that there is
+   nothing new.  Pixels are not locked, so a tile being traced as it is
+   read may be half drawn.  Everything is in the machine's byte order. */
+struct SharedImageHeader
+{
+    enum { FORMAT_RGB8 = 1 };       // 3 bytes a pixel, rows bottom to top
+
+    char magic[8];                  // "RAYIMG1"
+    uint32_t headerSize;            // sizeof(SharedImageHeader)
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t tileSize;              // tiles are tileSize pixels square
+    uint32_t tilesX, tilesY;
+    uint32_t finished;              // 1 once every pass is done
+    uint64_t bitmapOffset;
+    uint64_t pixelOffset;
+    uint64_t mappingSize;
+    std::atomic<uint64_t> sequence; // bumped after every update
+};
+
+class SharedImage
+{
+public:
+    SharedImage();
+    ~SharedImage();
+
+    // Map a width x height image in tiles of tileSize, and fill in its
+    // header.  A name without a '/' is a POSIX shared memory object
+    // ("/name"), anything else a file.  Either is left behind when the
+    // image is unmapped, so the finished render stays readable; whoever
+    // reads it removes it.  Returns false if it can't be mapped.
+    bool create(const char* name, int width, int height, int tileSize);
+
+    unsigned char* pixels() const { return _base + _header->pixelOffset; }
+
+    // The tile with top-left pixel (x, y) is finished.  Updates are
+    // expected from one thread.
+    void tileDone(int x, int y);
+    // Pixels have changed outside of tiles (a pass over the whole image).
+    void changed();
+    void finish();
+
+private:
+    void close();
+
+    unsigned char* _base;
+    SharedImageHeader* _header;
+    uint32_t* _bitmap;
+};
+
+#endif // SHAREDIMAGE_H
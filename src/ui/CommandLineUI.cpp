@@ -1,13 +1,21 @@
+#include <algorithm>
 #include <iostream>
 #include <time.h>
 #include <stdarg.h>
 
 #include <assert.h>
+#include <string.h>
 
 #include "CommandLineUI.h"
 #include "../fileio/bitmap.h"
+#include "../fileio/hdrimage.h"
+#include "../fileio/pngwriter.h"
 
 #include "../RayTracer.h"
+#include "../parallel.h"
+#include "../sharedImage.h"
+#include "../scene/light.h"
+#include "../scene/shadingCache.h"
 
 using namespace std;
 
@@ -19,11 +27,26 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 	int i;
 
 	progName=argv[0];
+	sampleMapName = NULL;
+	streamOutput = false;
+	sharedName = NULL;
     m_accelerate = false;
     m_nSampleSize = 1;
+    m_bJitter = false;
+    m_bAdaptiveSampling = false;
 
-	while( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	char options[] = "tr:w:h:a:dc:l:i:b:om:n:sgv:k:jefu:x:y:pq:";
+	while( (i = getopt( argc, argv, options )) != EOF )
 	{
+		// getopt() leaves optarg NULL when an option's value is missing.
+		const char* option = strchr( options, i );
+		if( option && option[1] == ':' && optarg == NULL )
+		{
+			std::cerr << "Option -" << (char)i << " needs a value." << std::endl;
+			usage();
+			exit(1);
+		}
+
 		switch( i )
 		{
 			case 'r':
@@ -33,6 +56,117 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+
+			case 'a':
+				if( !strcmp( optarg, "kdtree" ) )
+					m_nAccelStructure = ACCEL_KDTREE;
+				else if( !strcmp( optarg, "grid" ) )
+					m_nAccelStructure = ACCEL_GRID;
+				else if( !strcmp( optarg, "auto" ) )
+					m_nAccelStructure = ACCEL_AUTO;
+				else
+				{
+					std::cerr << "Unknown acceleration structure: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'd':
+				m_bDynamicScene = true;
+				break;
+
+			case 'c':
+				m_fRayThreshold = atof( optarg );
+				break;
+
+			case 'l':
+				m_nRouletteDepth = atoi( optarg );
+				break;
+
+			case 'i':
+				m_fLightCutoff = atof( optarg );
+				break;
+
+			case 'b':
+				m_nLightBudget = atoi( optarg );
+				break;
+
+			case 'o':
+				m_bOccluderCache = false;
+				break;
+
+			case 'm':
+				m_nShadowMapRes = atoi( optarg );
+				break;
+
+			case 'n':
+				m_nSampleSize = atoi( optarg );
+				break;
+
+			case 's':
+				m_bShadingCache = true;
+				break;
+
+			case 'g':
+				m_bSharedSamples = true;
+				break;
+
+			case 'v':
+				m_bAdaptiveSampling = true;
+				m_fAdaptiveThreshold = atof( optarg );
+				break;
+
+			case 'k':
+				sampleMapName = optarg;
+				break;
+
+			case 'j':
+				m_bJitter = true;
+				break;
+
+			case 'e':
+				m_bEdgeRedraw = true;
+				break;
+
+			case 'f':
+				m_bDenoise = true;
+				break;
+
+			case 'u':
+				m_nReduction = atoi( optarg );
+				if( m_nReduction != 1 && m_nReduction != 2 && m_nReduction != 4 )
+				{
+					std::cerr << "Reduction must be 1, 2 or 4." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'x':
+				m_fExposure = atof( optarg );
+				break;
+
+			case 'y':
+				if( !strcmp( optarg, "clamp" ) )
+					m_nToneMap = FrameBuffer::TONEMAP_CLAMP;
+				else if( !strcmp( optarg, "reinhard" ) )
+					m_nToneMap = FrameBuffer::TONEMAP_REINHARD;
+				else
+				{
+					std::cerr << "Unknown tone map: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'p':
+				streamOutput = true;
+				break;
+
+			case 'q':
+				sharedName = optarg;
+				break;
 			default:
 			// Oops; unknown argument
 			std::cerr << "Invalid argument: '" << i << "'." << std::endl;
@@ -61,27 +195,111 @@ int CommandLineUI::run()
 		int width = m_nSize;
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
+		if( streamOutput )
+			return renderStrips( width, height );
+
 		raytracer->traceSetup( width, height );
 
+		// Let other processes watch the image as it is traced.
+		const int tile = RayTracer::TILE_SIZE;
+		SharedImage shared;
+		if( sharedName )
+		{
+			if( !shared.create( sharedName, width, height, tile ) )
+			{
+				std::cerr << "Unable to map shared image '" << sharedName << "'" << std::endl;
+				return( 1 );
+			}
+			raytracer->useBuffer( shared.pixels() );
+		}
+
+		unsigned char* buf;
+		raytracer->getBuffer(buf, width, height);
+
+		// A PNG is compressed a strip at a time while the rest renders,
+		// unless a later pass will still change the pixels.
+		const RenderSettings& settings = raytracer->renderSettings();
+		PngWriter png;
+		bool writingPng = hasExtension( imgName, ".png" );
+		bool streaming = writingPng && settings.reduction <= 1 && !settings.edgeRedraw && !settings.denoise;
+		if( writingPng && !png.open( imgName, width, height, buf ) )
+		{
+			std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
+			return( 1 );
+		}
+
 		clock_t start, end;
 		start = clock();
 
-		for( int j = 0; j < height; ++j )
-			for( int i = 0; i < width; ++i )
-				raytracer->tracePixel(i,j);
+		for( int j = 0; j < height; j += tile )
+		{
+			for( int i = 0; i < width; i += tile )
+			{
+				raytracer->traceTile( i, j, min( i + tile, width ), min( j + tile, height ) );
+				if( sharedName )
+					shared.tileDone( i, j );
+			}
+			if( streaming )
+				png.rowsDone( j, min( j + tile, height ) );
+		}
+		int fullPixels = raytracer->upsample();
+		int edges = raytracer->resampleEdges();
+		raytracer->denoise();
+		if( sharedName )
+			shared.finish();
 
 		end=clock();
 
 		// save image
-		unsigned char* buf;
-
-		raytracer->getBuffer(buf, width, height);
-
-		if (buf)
-			writeBMP(imgName, width, height, buf);
+		if( writingPng )
+		{
+			if( !streaming )
+				png.rowsDone( 0, height );
+			if( !png.close() )
+				std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
+		}
+		else if (buf)
+			writeImage( imgName, width, height, buf );
 
 		double t=(double)(end-start)/CLOCKS_PER_SEC;
 		std::cout << "total time = " << t << " seconds" << std::endl;
+
+		const std::vector<unsigned long long>& rays = raytracer->rayCounts();
+		std::cout << "rays per depth =";
+		for( size_t d = 0; d < rays.size(); ++d )
+			std::cout << " " << rays[d];
+		std::cout << std::endl;
+		if( m_bOccluderCache )
+			std::cout << "occluder cache hits = " << OccluderCache::hits()
+				<< " / " << OccluderCache::tests() << std::endl;
+		if( m_nShadowMapRes > 0 )
+			std::cout << "shadow map resolved = " << ShadowMap::resolved()
+				<< " / " << ShadowMap::lookups() << std::endl;
+		if( m_bShadingCache )
+			std::cout << "shading cache hits = " << ShadingCache::hits()
+				<< " / " << ShadingCache::lookups() << std::endl;
+
+		if( m_nReduction > 1 )
+			std::cout << "pixels shaded in full while upsampling = " << fullPixels << " / " << width * height << std::endl;
+		if( m_bEdgeRedraw )
+			std::cout << "edge pixels resampled = " << edges << " / " << width * height << std::endl;
+
+		const std::vector<unsigned short>& samples = raytracer->sampleCounts();
+		if( ( m_bAdaptiveSampling || m_bEdgeRedraw ) && !samples.empty() )
+		{
+			unsigned long long total = 0;
+			int most = 0, least = samples[0];
+			for( size_t p = 0; p < samples.size(); ++p )
+			{
+				total += samples[p];
+				most = max( most, (int)samples[p] );
+				least = min( least, (int)samples[p] );
+			}
+			std::cout << "samples per pixel = " << (double)total / samples.size()
+				<< " (" << least << " to " << most << ")" << std::endl;
+		}
+		if( sampleMapName && !samples.empty() )
+			writeSampleMap( sampleMapName, width, height, samples );
         return 0;
 	}
 	else
@@ -91,6 +309,117 @@ int CommandLineUI::run()
 	}
 }
 
+// Render one tile row at a time, holding only that strip, and append each
+// to the output file as it finishes, so memory doesn't grow with the
+// image.  BMPs are written bottom up and PNGs top down, so strips are
+// rendered in that order.
+int CommandLineUI::renderStrips( int width, int height )
+{
+	bool png = hasExtension( imgName, ".png" );
+	if( !png && ( hasExtension( imgName, ".pfm" ) || hasExtension( imgName, ".exr" ) ) )
+	{
+		std::cerr << "Only BMP and PNG output can be streamed." << std::endl;
+		return( 1 );
+	}
+	if( !png && !fitsBMP( width, height ) )
+	{
+		std::cerr << "A BMP can't be larger than 4 GiB; write a PNG instead." << std::endl;
+		return( 1 );
+	}
+	if( sharedName )
+	{
+		std::cerr << "A streamed render holds no whole image to share." << std::endl;
+		return( 1 );
+	}
+
+	const int tile = RayTracer::TILE_SIZE;
+	raytracer->traceSetup( width, height, tile );
+
+	PngWriter pngWriter;
+	FILE* bmp = NULL;
+	if( png ? !pngWriter.open( imgName, width, height, NULL, tile ) : !( bmp = openBMP( imgName, width, height ) ) )
+	{
+		std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
+		return( 1 );
+	}
+
+	clock_t start = clock();
+	int strips = ( height + tile - 1 ) / tile;
+	for( int s = 0; s < strips; ++s )
+	{
+		int y0 = ( png ? strips - 1 - s : s ) * tile;
+		int y1 = min( y0 + tile, height );
+		raytracer->beginStrip( y0 );
+		for( int i = 0; i < width; i += tile )
+			raytracer->traceTile( i, y0, min( i + tile, width ), y1 );
+
+		unsigned char* buf;
+		int w, rows;
+		raytracer->getBuffer( buf, w, rows );
+		if( png )
+			pngWriter.addRows( buf, y0, y1 );
+		else
+			writeBMPRows( bmp, width, y1 - y0, buf );
+	}
+	bool written = png ? pngWriter.close() : fclose( bmp ) == 0;
+	clock_t end = clock();
+	if( !written )
+		std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
+
+	std::cout << "total time = " << (double)( end - start ) / CLOCKS_PER_SEC << " seconds" << std::endl;
+	const std::vector<unsigned long long>& rays = raytracer->rayCounts();
+	std::cout << "rays per depth =";
+	for( size_t d = 0; d < rays.size(); ++d )
+		std::cout << " " << rays[d];
+	std::cout << std::endl;
+	return written ? 0 : 1;
+}
+
+// Save the samples each pixel took as a grey image, white being the most
+// any pixel took.
+void CommandLineUI::writeSampleMap( const char* name, int width, int height,
+	const std::vector<unsigned short>& samples )
+{
+	int most = *max_element( samples.begin(), samples.end() );
+	std::vector<unsigned char> grey( width * height * 3 );
+	for( int p = 0; p < width * height; ++p )
+	{
+		unsigned char v = (unsigned char)( 255 * samples[p] / max( most, 1 ) );
+		grey[p * 3] = grey[p * 3 + 1] = grey[p * 3 + 2] = v;
+	}
+	writeBMP( name, width, height, &grey[0] );
+}
+
+bool CommandLineUI::hasExtension( const char* name, const char* extension )
+{
+	const char* dot = strrchr( name, '.' );
+	return dot && !strcasecmp( dot, extension );
+}
+
+// Save the render in the format the name's extension asks for: the
+// unclamped frame buffer for .pfm and .exr, else the tone mapped image as
+// a BMP.  PNGs are written by run() as the render goes.
+void CommandLineUI::writeImage( const char* name, int width, int height, unsigned char* buf )
+{
+	bool pfm = hasExtension( name, ".pfm" );
+	bool exr = hasExtension( name, ".exr" );
+	if( !pfm && !exr )
+	{
+		writeBMP( name, width, height, buf );
+		return;
+	}
+
+	const FrameBuffer& frame = raytracer->frameBuffer();
+	std::vector<float> rgba( width * height * 4 );
+	parallelChunks( 0, height, [&]( int y0, int y1, unsigned int ) {
+		frame.resolve( &rgba[y0 * width * 4], y0 * width, y1 * width );
+	} );
+	bool written = pfm ? writePFM( name, width, height, &rgba[0] )
+		: writeEXR( name, width, height, &rgba[0] );
+	if( !written )
+		std::cerr << "Unable to write image '" << name << "'" << std::endl;
+}
+
 void CommandLineUI::alert( const string& msg )
 {
 	std::cerr << msg << std::endl;
@@ -98,7 +427,28 @@ void CommandLineUI::alert( const string& msg )
 
 void CommandLineUI::usage()
 {
-	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
+	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp|.png|.pfm|.exr]" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
+	std::cerr << "  -a <type>   acceleration structure: kdtree, grid or auto (default kdtree)" << std::endl;
+	std::cerr << "  -d          scene is rebuilt every frame (lets -a auto pick the grid)" << std::endl;
+	std::cerr << "  -c <#>      don't spawn rays carrying less weight than this (default " << m_fRayThreshold << ")" << std::endl;
+	std::cerr << "  -l <#>      Russian roulette on rays from this depth on (default off)" << std::endl;
+	std::cerr << "  -i <#>      ignore lights contributing less than this (default off)" << std::endl;
+	std::cerr << "  -b <#>      shade at most this many lights per hit, chosen at random (default all)" << std::endl;
+	std::cerr << "  -o          don't try each light's last shadow blocker before the full shadow test" << std::endl;
+	std::cerr << "  -m <#>      build a shadow map this many texels wide for every light (default off)" << std::endl;
+	std::cerr << "  -n <#>      supersample each pixel on an n x n grid (default 1)" << std::endl;
+	std::cerr << "  -s          share diffuse lighting between samples that hit a surface close together" << std::endl;
+	std::cerr << "  -g          supersample on a lattice whose edge and corner samples neighbouring pixels share" << std::endl;
+	std::cerr << "  -v <#>      supersample adaptively, until a pixel's standard error is under this (use with -n)" << std::endl;
+	std::cerr << "  -k <file>   save the samples each pixel took as a grey image" << std::endl;
+	std::cerr << "  -j          jitter the samples (scrambled Sobol points within each pixel)" << std::endl;
+	std::cerr << "  -e          trace at one sample per pixel, then supersample (-n, default 4) only the edges" << std::endl;
+	std::cerr << "  -u <#>      shade one pixel in # x # (2 or 4), then upsample guided by every pixel's primary hit" << std::endl;
+	std::cerr << "  -f          denoise the image, guided by the normals, depths and albedos of the primary hits" << std::endl;
+	std::cerr << "  -x <#>      exposure in stops, may be negative, applied before tone mapping (default 0)" << std::endl;
+	std::cerr << "  -y <type>   tone map for 8-bit output: clamp or reinhard (default clamp)" << std::endl;
+	std::cerr << "  -p          render a strip at a time straight to the output (BMP or PNG), in bounded memory" << std::endl;
+	std::cerr << "  -q <name>   trace into shared memory (/dev/shm/name, or a file if name has a '/') for live viewing" << std::endl;
 }
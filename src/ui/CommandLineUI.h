@@ -7,6 +7,8 @@
 #ifndef __CommandLineUI_h__
 #define __CommandLineUI_h__
 
+#include <vector>
+
 #include "TraceUI.h"
 
 // ***********************************************************
@@ -34,10 +36,18 @@ public:
 
 private:
 	void		usage();
+	void		writeSampleMap( const char* name, int width, int height,
+		const std::vector<unsigned short>& samples );
+	void		writeImage( const char* name, int width, int height, unsigned char* buf );
+	static bool	hasExtension( const char* name, const char* extension );
+	int			renderStrips( int width, int height );
 
 	char*	rayName;
 	char*	imgName;
 	char*	progName;
+	char*	sampleMapName;	// where to save the samples per pixel, or NULL
+	bool	streamOutput;	// render in strips straight to the file
+	char*	sharedName;		// shared image to trace into, or NULL
 };
 
 #endif
@@ -17,9 +17,8 @@
 #include "../RayTracer.h"
 #include "../globals.h"
 
-bool GraphicalUI::stopTrace = false;
-bool GraphicalUI::doneTrace = true;
 GraphicalUI* pUI;
+static const double REFRESH_INTERVAL = 1.0 / 30.0;	// seconds between redraws while rendering
 CubeMapChooser* cube;
 int m_nCube_filter;
 
@@ -41,9 +40,9 @@ void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v)
 	if (newfile != NULL) {
 		char buf[256];
 
+		stopTracing();	// terminate the previous rendering before the scene goes
 		if (pUI->raytracer->loadScene(newfile)) {
 			sprintf(buf, "Ray <%s>", newfile);
-			stopTracing();	// terminate the previous rendering
 		} else{
 			sprintf(buf, "Ray <Not Loaded>");
 		}
@@ -60,7 +59,7 @@ void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v)
 
 void GraphicalUI::cb_save_image(Fl_Menu_* o, void* v) 
 {
-	char* savefile = fl_file_chooser("Save Image?", "*.bmp", "save.bmp" );
+	char* savefile = fl_file_chooser("Save Image?", "*.{bmp,png}", "save.bmp" );
 	if (savefile != NULL)
 		whoami(o)->m_traceGlWindow->saveImage(savefile);
 }
@@ -169,76 +168,49 @@ void GraphicalUI::cb_accelerateCheckButton(Fl_Widget* o, void* v)
     pUI->m_accelerate = (((Fl_Check_Button*)o)->value() != 1);
 }
 
+// Start tracing in the background; cb_refresh() shows the image as it
+// comes.  Rendering again restarts the refinement from the preview.
 void GraphicalUI::cb_render(Fl_Widget* o, void* v)
-    {
-	char buffer[256];
-
+{
 	pUI=((GraphicalUI*)(o->user_data()));
-	
+
 	if (pUI->raytracer->sceneLoaded()) 
 	{
 		int width = pUI->getSize();
 		int	height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
 		pUI->m_traceGlWindow->resizeWindow( width, height );
 		pUI->m_traceGlWindow->show();
-		pUI->raytracer->traceSetup(width, height);
-		const char *old_label = pUI->m_traceGlWindow->label();
-		clock_t prev, now;
-		prev=clock();
-		pUI->m_traceGlWindow->refresh();
-		Fl::check();
-		Fl::flush();
-		doneTrace = false;
-		stopTrace = false;
-		for (int y=0; y<height; y++) 
-		{
-			for (int x=0; x<width; x++) 
-			{
-				if (stopTrace) 
-					break;
-				now = clock();
-				if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
-					prev=now;
-					pUI->m_traceGlWindow->refresh();
-					Fl::check();
-					if (Fl::damage())
-						Fl::flush();
-                }
-				pUI->raytracer->tracePixel( x, y );
-				pUI->m_debuggingWindow->m_debuggingView->setDirty();
-            }
-			if (stopTrace) 
-				break;
-			pUI->m_traceGlWindow->refresh();
-			Fl::check();
-			if (Fl::damage())
-				Fl::flush();
-			sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-			pUI->m_traceGlWindow->label(buffer);			
-		}
-        if(!stopTrace)
-        {
-            pUI->m_traceGlWindow->refresh();
-            Fl::check();
-
-            if (Fl::damage()) {
-                Fl::flush();
-            }
-            //pUI->raytracer->drawEdges();
-            pUI->m_traceGlWindow->refresh();
-            Fl::check();
-
-            if (Fl::damage()) {
-                Fl::flush();
-            }
-            pUI->m_traceGlWindow->label(buffer);}
-		doneTrace=true;
-		stopTrace=false;
-		pUI->m_traceGlWindow->refresh();
-		pUI->m_traceGlWindow->label(old_label);		
+		pUI->m_renderer.start( pUI->raytracer, width, height );
+		Fl::remove_timeout( cb_refresh, pUI );
+		Fl::add_timeout( REFRESH_INTERVAL, cb_refresh, pUI );
 	}
 }
 
+// Redraw the image if the renderer has finished any tiles since last
+// time, and show how far it has got.  Runs on FLTK's thread until the
+// render ends.
+void GraphicalUI::cb_refresh(void* v)
+{
+	GraphicalUI* ui = (GraphicalUI*)v;
+	ProgressiveRenderer& renderer = ui->m_renderer;
+	bool running = renderer.running();
+	if (renderer.changed())
+	{
+		ui->m_debuggingWindow->m_debuggingView->setDirty();
+		ui->m_traceGlWindow->refresh();
+	}
+	if (running)
+	{
+		char label[256];
+		sprintf(label, "(pass %d/%d, %d%%) Rendered Image", renderer.pass() + 1, renderer.passes(),
+			(int)(renderer.progress() * 100.0));
+		ui->m_traceGlWindow->copy_label(label);
+		Fl::repeat_timeout(REFRESH_INTERVAL, cb_refresh, v);
+	}
+	else
+		ui->m_traceGlWindow->copy_label("Rendered Image");
+}
+
 void GraphicalUI::cb_cubemap_checkbox(Fl_Widget* o, void* v)
 {
 	has_cube_map = (((Fl_Check_Button*)o)->value() == 1);
@@ -246,7 +218,7 @@ void GraphicalUI::cb_cubemap_checkbox(Fl_Widget* o, void* v)
 
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
 {
-	stopTrace = true;
+	stopTracing();
 }
 
 void GraphicalUI::cb_filter(Fl_Widget* o, void* v)
@@ -293,13 +265,17 @@ Fl_Menu_Item GraphicalUI::menuitems[] = {
 	{ 0 }
 };
 
+// Stop the background render, waiting for its threads to let go of the
+// scene and the image.
 void GraphicalUI::stopTracing()
 {
-	stopTrace = true;
+	if (pUI)
+		pUI->m_renderer.cancel();
 }
 
 GraphicalUI::GraphicalUI() {
 	// init.
+	pUI = this;
 
     m_mainWindow = new Fl_Window(100, 40, 500, 300, "Ray Tracer<EMPTY>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
@@ -403,6 +379,9 @@ GraphicalUI::GraphicalUI() {
         m_adaptiveSamplingButton->labelfont(FL_HELVETICA);
         m_adaptiveSamplingButton->labelsize(12);*/
 
+        // Re-rendering the same view only has to shade.
+        m_bHitCache = true;
+
         // set up acceleration checkbox
         m_accelerate = false;
         m_accelerateCheckButton = new Fl_Check_Button(0, 200, 180, 20, "Acceleration(K-d tree) (Toggle before load)");
@@ -23,6 +23,7 @@
 #include "TraceGLWindow.h"
 #include "debuggingWindow.h"
 #include "CubeMapChooser.h"
+#include "../progressiveRenderer.h"
 
 
 
@@ -75,6 +76,8 @@ public:
 
 	DebuggingWindow*	m_debuggingWindow;
 
+	ProgressiveRenderer	m_renderer;		// traces in the background
+
 	// member functions
 	void		setRayTracer(RayTracer *tracer);
 	RayTracer* getRayTracer() { return raytracer; }
@@ -118,9 +121,7 @@ private:
     static void cb_updateThresholds(Fl_Widget* o, void* v);
 
     static void cb_filter(Fl_Widget *o, void* v);
-
-	static bool doneTrace;		// Flag that gets set when the trace is done
-	static bool stopTrace;		// Flag that gets set when the trace should be stopped
+	static void cb_refresh(void* v);
 };
 
 #endif
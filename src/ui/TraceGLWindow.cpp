@@ -8,6 +8,7 @@
 #include "GraphicalUI.h"
 
 #include "../fileio/bitmap.h"
+#include "../fileio/pngwriter.h"
 
 extern bool debugMode;
 extern TraceUI* traceUI;
@@ -40,6 +41,8 @@ int TraceGLWindow::handle(int event)
 		if(raytracer) 
 		{
 			std::cout << "Tracing ray at " << x << ", " << y << std::endl;
+			// The background render mustn't trace alongside us.
+			GraphicalUI::stopTracing();
 			// Have we re-sized since drawing?
 			if(!raytracer->isReady()) 
 				raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight);
@@ -111,7 +114,12 @@ void TraceGLWindow::saveImage(char *iname)
 	unsigned char* buf;
 
 	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	if (buf)
+	if (!buf)
+		return;
+	const char* dot = strrchr(iname, '.');
+	if (dot && !strcasecmp(dot, ".png"))
+		writePNG(iname, m_nDrawWidth, m_nDrawHeight, buf);
+	else
 		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
 }
 
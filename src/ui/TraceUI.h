@@ -20,10 +20,28 @@ using std::string;
 
 class RayTracer;
 
+// Acceleration structures the ray tracer can build over the scene.
+enum AccelStructure
+{
+    ACCEL_KDTREE,       // SAH / median k-d tree; slow to build, fast to trace
+    ACCEL_GRID,         // uniform grid; O(N) parallel build
+    ACCEL_AUTO          // pick by cost estimate when the scene is dynamic
+};
+
 class TraceUI {
 public:
 	TraceUI()
 		: m_nDepth(0), m_nSize(150), 
+		m_fDepthThreshold( 0.05f ), m_fAngleThresholdA( 0.25f ),
+		m_fAngleThresholdB( 0.9f ), m_bEdgeRedraw( false ),
+		m_nAccelStructure( ACCEL_KDTREE ), m_bDynamicScene( false ),
+		m_fRefitThreshold( 1.5f ),
+		m_fRayThreshold( 0.0f ), m_nRouletteDepth( -1 ),
+		m_fLightCutoff( 0.0f ), m_nLightBudget( 0 ),
+		m_bOccluderCache( true ), m_nShadowMapRes( 0 ),
+		m_bShadingCache( false ), m_bHitCache( false ), m_bSharedSamples( false ),
+		m_fAdaptiveThreshold( 0.01f ), m_bDenoise( false ),
+		m_nReduction( 1 ), m_fExposure( 0.0f ), m_nToneMap( 0 ),
 		m_displayDebuggingInfo( false ),
 		raytracer( 0 )
 	{ }
@@ -53,6 +71,23 @@ public:
     bool    nonRealism() const { return m_bNonRealism;}
     bool    edgeRedraw() const { return m_bEdgeRedraw;}
     int     getFilterWidth() const {return m_nFilterWidth; }
+    int     accelStructure() const { return m_nAccelStructure; }
+    bool    dynamicScene() const { return m_bDynamicScene; }
+    float   refitThreshold() const { return m_fRefitThreshold; }
+    float   rayThreshold() const { return m_fRayThreshold; }
+    int     rouletteDepth() const { return m_nRouletteDepth; }
+    float   lightCutoff() const { return m_fLightCutoff; }
+    int     lightBudget() const { return m_nLightBudget; }
+    bool    occluderCache() const { return m_bOccluderCache; }
+    int     shadowMapRes() const { return m_nShadowMapRes; }
+    bool    shadingCache() const { return m_bShadingCache; }
+    bool    hitCache() const { return m_bHitCache; }
+    bool    sharedSamples() const { return m_bSharedSamples; }
+    float   adaptiveThreshold() const { return m_fAdaptiveThreshold; }
+    bool    denoise() const { return m_bDenoise; }
+    int     reduction() const { return m_nReduction; }
+    float   exposure() const { return m_fExposure; }
+    int     toneMap() const { return m_nToneMap; }
 
 	RayTracer*	raytracer;
 
@@ -71,11 +106,28 @@ public:
     bool        m_bSurfaceHeuristic;
     bool        m_bAdaptiveSampling;
     float       m_fBumpScale;
-    float       m_fDepthThreshold;
-    float       m_fAngleThresholdA;
-    float       m_fAngleThresholdB;
+    float       m_fDepthThreshold;      // edge redraw: relative depth jump that makes an edge
+    float       m_fAngleThresholdA;     // edge redraw: change in view angle cosine
+    float       m_fAngleThresholdB;     // edge redraw: min cosine between neighbouring normals
     bool        m_bNonRealism;
-    bool        m_bEdgeRedraw;
+    bool        m_bEdgeRedraw;          // supersample only the edges of a 1 spp render
+    int         m_nAccelStructure;      // one of AccelStructure
+    bool        m_bDynamicScene;        // scene is rebuilt every frame
+    float       m_fRefitThreshold;      // rebuild a refit k-d tree past this SAH cost ratio
+    float       m_fRayThreshold;        // don't spawn rays that would carry less weight than this
+    int         m_nRouletteDepth;       // Russian roulette from this depth on (-1: never)
+    float       m_fLightCutoff;         // ignore lights contributing less than this (0: off)
+    int         m_nLightBudget;         // shade at most this many lights per hit (0: all)
+    bool        m_bOccluderCache;       // try each light's last shadow blocker first
+    int         m_nShadowMapRes;        // shadow map side per light (0: no maps)
+    bool        m_bShadingCache;        // share diffuse lighting between a pixel's samples
+    bool        m_bHitCache;            // keep primary hits for re-renders of the same view
+    bool        m_bSharedSamples;       // pixels share their edge and corner samples
+    float       m_fAdaptiveThreshold;   // adaptive sampling stops under this standard error
+    bool        m_bDenoise;             // filter the image once it's traced
+    int         m_nReduction;           // shade at 1/m_nReduction resolution and upsample (1: off)
+    float       m_fExposure;            // stops of exposure for the displayed image
+    int         m_nToneMap;             // FrameBuffer::ToneMap for the displayed image
 
 
 